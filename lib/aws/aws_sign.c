@@ -1,29 +1,93 @@
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "asprintf.h"
 #include "hexify.h"
+#include "insecure_memzero.h"
 #include "sha256.h"
 #include "warnp.h"
 
 #include "aws_sign.h"
 
+/* State for signing the chunks of an aws-chunked request body. */
+struct aws_sign_chunked {
+	HMAC_SHA256_CTX kctx;
+	char datetime[17];
+	char * scope;
+	char seedsig[65];
+	char prevsig[65];
+};
+
+/*
+ * Bytes of aws-chunked encoding around each chunk, aside from its length in
+ * hex: ";chunk-signature=", a 64-character signature, and two CRLFs.
+ */
+#define CHUNKOVER	(17 + 64 + 2 + 2)
+
+/* Hexified SHA256 of an empty string. */
+static const char * empty_sha256 =
+    "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+
+/*
+ * Signing keys only change when the date does, so we keep recently derived
+ * keys in a small cache, indexed by the SHA256 of the secret key along with
+ * the date, region, and service.  We store HMAC contexts which have already
+ * absorbed the signing key, so each signature costs only the HMAC of the
+ * String to Sign.
+ */
+#define KEYCACHE_SIZE	8
+static struct keycache_entry {
+	int valid;
+	uint8_t h_secret[32];
+	char date[9];
+	char region[32];
+	char service[16];
+	HMAC_SHA256_CTX kctx;
+} keycache[KEYCACHE_SIZE];
+static size_t keycache_next = 0;
+static pthread_mutex_t keycache_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Set ${kctx} to an HMAC-SHA256 context keyed with the signing key for
+ * ${date}, ${region}, and ${service}, taking it from the cache if possible.
+ */
 static int
-aws_sign(const char * key_secret, const char * date, const char * datetime,
-    const char * region, const char * service, const char * creq,
-    char sigbuf[65])
+aws_sign_key(const char * key_secret, const char * date, const char * region,
+    const char * service, HMAC_SHA256_CTX * kctx)
 {
+	struct keycache_entry * E;
+	uint8_t h_secret[32];
 	char * AWS4_key;
 	uint8_t kDate[32];
 	uint8_t kRegion[32];
 	uint8_t kService[32];
 	uint8_t kSigning[32];
-	uint8_t h_creq[32];
-	char hhex_creq[65];
-	char * STS;
-	uint8_t hmac[32];
+	size_t i;
+	int rc;
+
+	/* Look for the key in the cache. */
+	SHA256_Buf(key_secret, strlen(key_secret), h_secret);
+	if ((rc = pthread_mutex_lock(&keycache_mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+	for (i = 0; i < KEYCACHE_SIZE; i++) {
+		E = &keycache[i];
+		if (E->valid && (memcmp(E->h_secret, h_secret, 32) == 0) &&
+		    (strcmp(E->date, date) == 0) &&
+		    (strcmp(E->region, region) == 0) &&
+		    (strcmp(E->service, service) == 0)) {
+			memcpy(kctx, &E->kctx, sizeof(HMAC_SHA256_CTX));
+			pthread_mutex_unlock(&keycache_mtx);
+			goto done;
+		}
+	}
+	pthread_mutex_unlock(&keycache_mtx);
 
 	/* Construct "AWS4" + key_secret. */
 	if (asprintf(&AWS4_key, "AWS4%s", key_secret) == -1)
@@ -42,29 +106,85 @@ aws_sign(const char * key_secret, const char * date, const char * datetime,
 	HMAC_SHA256_Buf(kService, 32, "aws4_request", strlen("aws4_request"),
 	    kSigning);
 
-	/* Free string allocated by asprintf. */
+	/* Absorb the signing key into an HMAC context. */
+	HMAC_SHA256_Init(kctx, kSigning, 32);
+
+	/* Clean up intermediate keys. */
+	insecure_memzero(AWS4_key, strlen(AWS4_key));
 	free(AWS4_key);
+	insecure_memzero(kDate, 32);
+	insecure_memzero(kRegion, 32);
+	insecure_memzero(kService, 32);
+	insecure_memzero(kSigning, 32);
+
+	/* Add it to the cache, if the names fit, replacing the oldest key. */
+	if ((strlen(date) < sizeof(E->date)) &&
+	    (strlen(region) < sizeof(E->region)) &&
+	    (strlen(service) < sizeof(E->service))) {
+		if ((rc = pthread_mutex_lock(&keycache_mtx)) != 0) {
+			warn0("pthread_mutex_lock: %s", strerror(rc));
+			goto err0;
+		}
+		E = &keycache[keycache_next];
+		keycache_next = (keycache_next + 1) % KEYCACHE_SIZE;
+		memcpy(E->h_secret, h_secret, 32);
+		strcpy(E->date, date);
+		strcpy(E->region, region);
+		strcpy(E->service, service);
+		memcpy(&E->kctx, kctx, sizeof(HMAC_SHA256_CTX));
+		E->valid = 1;
+		pthread_mutex_unlock(&keycache_mtx);
+	}
+
+done:
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+static int
+aws_sign(const char * key_secret, const char * date, const char * datetime,
+    const char * region, const char * service, const char * creq,
+    char sigbuf[65])
+{
+	HMAC_SHA256_CTX ctx;
+	uint8_t h_creq[32];
+	char hhex_creq[65];
+	uint8_t hmac[32];
+
+	/* Get an HMAC context keyed with the signing key. */
+	if (aws_sign_key(key_secret, date, region, service, &ctx))
+		goto err0;
 
 	/* Generate the hexified hash of the Canonical Request string. */
 	SHA256_Buf(creq, strlen(creq), h_creq);
 	hexify(h_creq, hhex_creq, 32);
 
-	/* Construct the String to Sign. */
-	if (asprintf(&STS,
-	    "AWS4-HMAC-SHA256\n"
-	    "%s\n"
-	    "%s/%s/%s/aws4_request\n"
-	    "%s",
-	    datetime, date, region, service, hhex_creq) == -1)
-		goto err0;
-
-	/* Sign and hexify the String to Sign. */
-	HMAC_SHA256_Buf(kSigning, 32, STS, strlen(STS), hmac);
+	/*
+	 * Sign the String to Sign:
+	 *   AWS4-HMAC-SHA256\n
+	 *   <datetime>\n
+	 *   <date>/<region>/<service>/aws4_request\n
+	 *   <hhex_creq>
+	 */
+	HMAC_SHA256_Update(&ctx, "AWS4-HMAC-SHA256\n", 17);
+	HMAC_SHA256_Update(&ctx, datetime, strlen(datetime));
+	HMAC_SHA256_Update(&ctx, "\n", 1);
+	HMAC_SHA256_Update(&ctx, date, strlen(date));
+	HMAC_SHA256_Update(&ctx, "/", 1);
+	HMAC_SHA256_Update(&ctx, region, strlen(region));
+	HMAC_SHA256_Update(&ctx, "/", 1);
+	HMAC_SHA256_Update(&ctx, service, strlen(service));
+	HMAC_SHA256_Update(&ctx, "/aws4_request\n", 14);
+	HMAC_SHA256_Update(&ctx, hhex_creq, 64);
+	HMAC_SHA256_Final(hmac, &ctx);
+
+	/* Hexify the signature. */
 	hexify(hmac, sigbuf, 32);
 
-	/* Free string allocated by asprintf. */
-	free(STS);
-
 	/* Success! */
 	return (0);
 
@@ -94,11 +214,43 @@ aws_sign_s3_headers(const char * key_id, const char * key_secret,
     const char * path, const uint8_t * body, size_t bodylen,
     char ** x_amz_content_sha256, char ** x_amz_date, char ** authorization)
 {
+	uint8_t hbuf[32];
+	char content_sha256[65];
+
+	/* Compute the hexified SHA256 of the payload. */
+	SHA256_Buf(body, body ? bodylen : 0, hbuf);
+	hexify(hbuf, content_sha256, 32);
+
+	/* Sign the request. */
+	return (aws_sign_s3_headers_prehashed(key_id, key_secret, region,
+	    method, bucket, path, content_sha256, NULL, x_amz_content_sha256,
+	    x_amz_date, authorization));
+}
+
+/**
+ * aws_sign_s3_headers_prehashed(key_id, key_secret, region, method, bucket,
+ *     path, content_sha256, checksum_crc32c, x_amz_content_sha256,
+ *     x_amz_date, authorization):
+ * As aws_sign_s3_headers(), except that instead of being given the request
+ * body, the caller provides ${content_sha256}, the hexified SHA256 of the
+ * body, or "UNSIGNED-PAYLOAD" if the body should not be covered by the
+ * signature.  This allows a body to be hashed once and signed repeatedly.
+ * If ${checksum_crc32c} is not NULL, the request must also include
+ *   X-Amz-Checksum-CRC32C: ${checksum_crc32c}
+ * which is covered by the signature.
+ */
+int
+aws_sign_s3_headers_prehashed(const char * key_id, const char * key_secret,
+    const char * region, const char * method, const char * bucket,
+    const char * path, const char * content_sha256,
+    const char * checksum_crc32c, char ** x_amz_content_sha256,
+    char ** x_amz_date, char ** authorization)
+{
+	const char * signedheaders;
 	time_t t_now;
+	struct tm tm_now;
 	char date[9];
 	char datetime[17];
-	uint8_t hbuf[32];
-	char content_sha256[65];
 	char * canonical_request;
 	char sigbuf[65];
 
@@ -108,21 +260,30 @@ aws_sign_s3_headers(const char * key_id, const char * key_secret,
 		goto err0;
 	}
 
+	/* Convert to UTC; we may be called from multiple threads. */
+	if (gmtime_r(&t_now, &tm_now) == NULL) {
+		warnp("gmtime_r");
+		goto err0;
+	}
+
 	/* Construct date string <yyyymmdd>. */
-	if (strftime(date, 9, "%Y%m%d", gmtime(&t_now)) == 0) {
+	if (strftime(date, 9, "%Y%m%d", &tm_now) == 0) {
 		warnp("strftime");
 		goto err0;
 	}
 
 	/* Construct date-and-time string <yyyymmddThhmmssZ>. */
-	if (strftime(datetime, 17, "%Y%m%dT%H%M%SZ", gmtime(&t_now)) == 0) {
+	if (strftime(datetime, 17, "%Y%m%dT%H%M%SZ", &tm_now) == 0) {
 		warnp("strftime");
 		goto err0;
 	}
 
-	/* Compute the hexified SHA256 of the payload. */
-	SHA256_Buf(body, body ? bodylen : 0, hbuf);
-	hexify(hbuf, content_sha256, 32);
+	/* Which headers are we signing? */
+	if (checksum_crc32c != NULL)
+		signedheaders = "host;x-amz-checksum-crc32c;"
+		    "x-amz-content-sha256;x-amz-date";
+	else
+		signedheaders = "host;x-amz-content-sha256;x-amz-date";
 
 	/* Construct Canonical Request. */
 	if (asprintf(&canonical_request,
@@ -130,13 +291,17 @@ aws_sign_s3_headers(const char * key_id, const char * key_secret,
 	    "%s\n"
 	    "\n"
 	    "host:%s.s3.amazonaws.com\n"
+	    "%s%s%s"
 	    "x-amz-content-sha256:%s\n"
 	    "x-amz-date:%s\n"
 	    "\n"
-	    "host;x-amz-content-sha256;x-amz-date\n"
+	    "%s\n"
 	    "%s",
-	    method, path, bucket, content_sha256, datetime,
-	    content_sha256) == -1)
+	    method, path, bucket,
+	    checksum_crc32c ? "x-amz-checksum-crc32c:" : "",
+	    checksum_crc32c ? checksum_crc32c : "",
+	    checksum_crc32c ? "\n" : "",
+	    content_sha256, datetime, signedheaders, content_sha256) == -1)
 		goto err0;
 
 	/* Compute request signature. */
@@ -148,9 +313,9 @@ aws_sign_s3_headers(const char * key_id, const char * key_secret,
 	if (asprintf(authorization,
 	    "AWS4-HMAC-SHA256 "
 	    "Credential=%s/%s/%s/s3/aws4_request,"
-	    "SignedHeaders=host;x-amz-content-sha256;x-amz-date,"
+	    "SignedHeaders=%s,"
 	    "Signature=%s",
-	    key_id, date, region, sigbuf) == -1)
+	    key_id, date, region, signedheaders, sigbuf) == -1)
 		goto err1;
 
 	/* Duplicate X-Amz-Content-SHA256 and X-Amz-Date headers. */
@@ -177,46 +342,286 @@ err0:
 }
 
 /**
- * aws_sign_s3_querystr(key_id, key_secret, region, method, bucket, path,
- *     expiry):
- * Return a query string ${query} such that
- *   ${method} http://${bucket}.s3.amazonaws.com${path}?${query}
- * is a correctly signed request which expires in ${expiry} seconds, assuming
- * that the ${bucket} S3 bucket is in region ${region}.
+ * aws_sign_s3_chunked_init(key_id, key_secret, region, method, bucket, path,
+ *     decodedlen, x_amz_date, authorization):
+ * Return state for signing a ${decodedlen}-byte request body sent using
+ * aws-chunked encoding, and values ${x_amz_date} and ${authorization} such
+ * that
+ *   ${method} ${path} HTTP/1.1
+ *   Host: ${bucket}.s3.amazonaws.com
+ *   X-Amz-Date: ${x_amz_date}
+ *   X-Amz-Content-SHA256: STREAMING-AWS4-HMAC-SHA256-PAYLOAD
+ *   X-Amz-Decoded-Content-Length: ${decodedlen}
+ *   Content-Encoding: aws-chunked
+ *   Authorization: ${authorization}
+ *   Content-Length: <aws_sign_s3_chunked_len(${decodedlen}, chunklen)>
+ * followed by the body in chunks of ${chunklen} bytes (except that the last
+ * may be shorter), each preceded by the header from aws_sign_s3_chunked()
+ * and followed by "\r\n", and then by an empty chunk in the same manner, is
+ * a correctly signed request to the ${region} S3 region.  All chunks except
+ * the last two must be at least 8192 bytes long.
  */
-char *
-aws_sign_s3_querystr(const char * key_id, const char * key_secret,
+struct aws_sign_chunked *
+aws_sign_s3_chunked_init(const char * key_id, const char * key_secret,
     const char * region, const char * method, const char * bucket,
-    const char * path, int expiry)
+    const char * path, uint64_t decodedlen, char ** x_amz_date,
+    char ** authorization)
 {
+	struct aws_sign_chunked * S;
 	time_t t_now;
+	struct tm tm_now;
 	char date[9];
-	char datetime[17];
-	char * s;
-	char hhex[65];
+	char * canonical_request;
+
+	/* Allocate signing state. */
+	if ((S = malloc(sizeof(struct aws_sign_chunked))) == NULL)
+		goto err0;
 
 	/* Get the current time. */
 	if (time(&t_now) == (time_t)(-1)) {
 		warnp("time");
-		goto err0;
+		goto err1;
+	}
+
+	/* Convert to UTC; we may be called from multiple threads. */
+	if (gmtime_r(&t_now, &tm_now) == NULL) {
+		warnp("gmtime_r");
+		goto err1;
 	}
 
 	/* Construct date string <yyyymmdd>. */
-	if (strftime(date, 9, "%Y%m%d", gmtime(&t_now)) == 0) {
+	if (strftime(date, 9, "%Y%m%d", &tm_now) == 0) {
 		warnp("strftime");
-		goto err0;
+		goto err1;
 	}
 
 	/* Construct date-and-time string <yyyymmddThhmmssZ>. */
-	if (strftime(datetime, 17, "%Y%m%dT%H%M%SZ", gmtime(&t_now)) == 0) {
+	if (strftime(S->datetime, 17, "%Y%m%dT%H%M%SZ", &tm_now) == 0) {
 		warnp("strftime");
-		goto err0;
+		goto err1;
 	}
 
-	/* Construct Canonical Request string. */
-	if (asprintf(&s,
+	/* Construct Canonical Request. */
+	if (asprintf(&canonical_request,
 	    "%s\n"
 	    "%s\n"
+	    "\n"
+	    "content-encoding:aws-chunked\n"
+	    "host:%s.s3.amazonaws.com\n"
+	    "x-amz-content-sha256:STREAMING-AWS4-HMAC-SHA256-PAYLOAD\n"
+	    "x-amz-date:%s\n"
+	    "x-amz-decoded-content-length:%" PRIu64 "\n"
+	    "\n"
+	    "content-encoding;host;x-amz-content-sha256;x-amz-date;"
+	    "x-amz-decoded-content-length\n"
+	    "STREAMING-AWS4-HMAC-SHA256-PAYLOAD",
+	    method, path, bucket, S->datetime, decodedlen) == -1)
+		goto err1;
+
+	/* Compute the seed signature, which the first chunk chains from. */
+	if (aws_sign(key_secret, date, S->datetime, region,
+	    "s3", canonical_request, S->seedsig))
+		goto err2;
+	memcpy(S->prevsig, S->seedsig, 65);
+
+	/* Get the signing key and scope for signing chunks. */
+	if (aws_sign_key(key_secret, date, region, "s3", &S->kctx))
+		goto err2;
+	if (asprintf(&S->scope, "%s/%s/s3/aws4_request", date, region) == -1)
+		goto err2;
+
+	/* Construct Authorization header. */
+	if (asprintf(authorization,
+	    "AWS4-HMAC-SHA256 "
+	    "Credential=%s/%s/%s/s3/aws4_request,"
+	    "SignedHeaders=content-encoding;host;x-amz-content-sha256;"
+	    "x-amz-date;x-amz-decoded-content-length,"
+	    "Signature=%s",
+	    key_id, date, region, S->seedsig) == -1)
+		goto err3;
+
+	/* Duplicate X-Amz-Date header. */
+	if ((*x_amz_date = strdup(S->datetime)) == NULL)
+		goto err4;
+
+	/* Free string allocated by asprintf. */
+	free(canonical_request);
+
+	/* Success! */
+	return (S);
+
+err4:
+	free(*authorization);
+err3:
+	free(S->scope);
+err2:
+	free(canonical_request);
+err1:
+	insecure_memzero(S, sizeof(struct aws_sign_chunked));
+	free(S);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * aws_sign_s3_chunked_len(decodedlen, chunklen):
+ * Return the length of a ${decodedlen}-byte body in aws-chunked encoding,
+ * when it is sent in chunks of ${chunklen} bytes as described above.
+ */
+uint64_t
+aws_sign_s3_chunked_len(uint64_t decodedlen, size_t chunklen)
+{
+	uint64_t nfull = decodedlen / chunklen;
+	size_t lastlen = (size_t)(decodedlen % chunklen);
+	char hex[17];
+	uint64_t len;
+
+	/* Each chunk has a header, its data, and a trailing CRLF. */
+	len = nfull * ((uint64_t)sprintf(hex, "%zx", chunklen) + CHUNKOVER);
+	if (lastlen > 0)
+		len += (uint64_t)sprintf(hex, "%zx", lastlen) + CHUNKOVER;
+	len += decodedlen;
+
+	/* The body ends with an empty chunk. */
+	len += 1 + CHUNKOVER;
+
+	return (len);
+}
+
+/**
+ * aws_sign_s3_chunked(S, buf, len, hdr):
+ * Sign the next ${len}-byte chunk ${buf} of the body using the state ${S},
+ * and write the header which must precede it to ${hdr}.  The body must be
+ * terminated by a chunk with ${len} = 0.
+ */
+void
+aws_sign_s3_chunked(struct aws_sign_chunked * S, const uint8_t * buf,
+    size_t len, char hdr[AWS_SIGN_CHUNKHDR_MAX])
+{
+	HMAC_SHA256_CTX ctx;
+	uint8_t hbuf[32];
+	char hhex[65];
+	uint8_t hmac[32];
+
+	/* Hash the chunk data. */
+	SHA256_Buf(buf, len, hbuf);
+	hexify(hbuf, hhex, 32);
+
+	/* Sign the String to Sign, which chains from the last signature. */
+	memcpy(&ctx, &S->kctx, sizeof(HMAC_SHA256_CTX));
+	HMAC_SHA256_Update(&ctx, "AWS4-HMAC-SHA256-PAYLOAD\n", 25);
+	HMAC_SHA256_Update(&ctx, S->datetime, 16);
+	HMAC_SHA256_Update(&ctx, "\n", 1);
+	HMAC_SHA256_Update(&ctx, S->scope, strlen(S->scope));
+	HMAC_SHA256_Update(&ctx, "\n", 1);
+	HMAC_SHA256_Update(&ctx, S->prevsig, 64);
+	HMAC_SHA256_Update(&ctx, "\n", 1);
+	HMAC_SHA256_Update(&ctx, empty_sha256, 64);
+	HMAC_SHA256_Update(&ctx, "\n", 1);
+	HMAC_SHA256_Update(&ctx, hhex, 64);
+	HMAC_SHA256_Final(hmac, &ctx);
+	hexify(hmac, S->prevsig, 32);
+
+	/* Construct the chunk header. */
+	sprintf(hdr, "%zx;chunk-signature=%s\r\n", len, S->prevsig);
+}
+
+/**
+ * aws_sign_s3_chunked_rewind(S):
+ * Reset the state ${S} so that the body can be signed again from its first
+ * chunk, e.g., in order to resend the request.
+ */
+void
+aws_sign_s3_chunked_rewind(struct aws_sign_chunked * S)
+{
+
+	/* The first chunk chains from the seed signature. */
+	memcpy(S->prevsig, S->seedsig, 65);
+}
+
+/**
+ * aws_sign_s3_chunked_free(S):
+ * Free the chunk-signing state ${S}.
+ */
+void
+aws_sign_s3_chunked_free(struct aws_sign_chunked * S)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (S == NULL)
+		return;
+
+	/* Free the scope string, and wipe the signing key. */
+	free(S->scope);
+	insecure_memzero(S, sizeof(struct aws_sign_chunked));
+	free(S);
+}
+
+/* State for generating presigned S3 query strings. */
+struct aws_sign_presign {
+	HMAC_SHA256_CTX stsctx;
+	char * creqtail;
+	size_t creqtaillen;
+	char * qprefix;
+	size_t qprefixlen;
+};
+
+/**
+ * aws_sign_s3_presign_init(key_id, key_secret, region, bucket, expiry,
+ *     xmlesc):
+ * Prepare to generate query strings for presigned requests to the ${bucket}
+ * S3 bucket in region ${region}, which expire in ${expiry} seconds.  All of
+ * the query strings share a single timestamp.  If ${xmlesc} is non-zero, the
+ * '&' characters separating query parameters are written as "&amp;" so that
+ * the query strings can be embedded in XML.  The returned state is not
+ * modified by aws_sign_s3_presign() and may be used by multiple threads.
+ */
+struct aws_sign_presign *
+aws_sign_s3_presign_init(const char * key_id, const char * key_secret,
+    const char * region, const char * bucket, int expiry, int xmlesc)
+{
+	struct aws_sign_presign * P;
+	time_t t_now;
+	struct tm tm_now;
+	char date[9];
+	char datetime[17];
+	const char * amp = xmlesc ? "&amp;" : "&";
+	int len;
+
+	/* Allocate a structure. */
+	if ((P = malloc(sizeof(struct aws_sign_presign))) == NULL)
+		goto err0;
+
+	/* Get the current time. */
+	if (time(&t_now) == (time_t)(-1)) {
+		warnp("time");
+		goto err1;
+	}
+
+	/* Convert to UTC; we may be called from multiple threads. */
+	if (gmtime_r(&t_now, &tm_now) == NULL) {
+		warnp("gmtime_r");
+		goto err1;
+	}
+
+	/* Construct date string <yyyymmdd>. */
+	if (strftime(date, 9, "%Y%m%d", &tm_now) == 0) {
+		warnp("strftime");
+		goto err1;
+	}
+
+	/* Construct date-and-time string <yyyymmddThhmmssZ>. */
+	if (strftime(datetime, 17, "%Y%m%dT%H%M%SZ", &tm_now) == 0) {
+		warnp("strftime");
+		goto err1;
+	}
+
+	/*
+	 * Construct the part of the Canonical Request string which follows
+	 * the method and path; it is the same for every request.
+	 */
+	if ((len = asprintf(&P->creqtail,
 	    "X-Amz-Algorithm=AWS4-HMAC-SHA256&"
 	    "X-Amz-Credential=%s%%2F%s%%2F%s%%2F%s%%2Faws4_request&"
 	    "X-Amz-Date=%s&"
@@ -226,32 +631,179 @@ aws_sign_s3_querystr(const char * key_id, const char * key_secret,
 	    "\n"
 	    "host\n"
 	    "UNSIGNED-PAYLOAD",
-	    method, path, key_id, date, region, "s3", datetime, expiry,
-	    bucket) == -1)
-		goto err0;
-
-	if (aws_sign(key_secret, date, datetime, region, "s3", s, hhex))
+	    key_id, date, region, "s3", datetime, expiry, bucket)) == -1)
 		goto err1;
+	P->creqtaillen = (size_t)len;
+
+	/* Construct the query parameters which precede the signature. */
+	if ((len = asprintf(&P->qprefix,
+	    "X-Amz-Algorithm=AWS4-HMAC-SHA256%s"
+	    "X-Amz-Credential=%s%%2F%s%%2F%s%%2F%s%%2Faws4_request%s"
+	    "X-Amz-Date=%s%s"
+	    "X-Amz-Expires=%d%s"
+	    "X-Amz-SignedHeaders=host%s"
+	    "X-Amz-Signature=",
+	    amp, key_id, date, region, "s3", amp, datetime, amp, expiry, amp,
+	    amp)) == -1)
+		goto err2;
+	P->qprefixlen = (size_t)len;
+
+	/*
+	 * Absorb everything in the String to Sign except for the hash of the
+	 * Canonical Request:
+	 *   AWS4-HMAC-SHA256\n
+	 *   <datetime>\n
+	 *   <date>/<region>/s3/aws4_request\n
+	 */
+	if (aws_sign_key(key_secret, date, region, "s3", &P->stsctx))
+		goto err3;
+	HMAC_SHA256_Update(&P->stsctx, "AWS4-HMAC-SHA256\n", 17);
+	HMAC_SHA256_Update(&P->stsctx, datetime, strlen(datetime));
+	HMAC_SHA256_Update(&P->stsctx, "\n", 1);
+	HMAC_SHA256_Update(&P->stsctx, date, strlen(date));
+	HMAC_SHA256_Update(&P->stsctx, "/", 1);
+	HMAC_SHA256_Update(&P->stsctx, region, strlen(region));
+	HMAC_SHA256_Update(&P->stsctx, "/s3/aws4_request\n", 17);
 
-	/* Free the Canonical Request string. */
-	free(s);
+	/* Success! */
+	return (P);
 
-	/* Construct the query parameters. */
-	if (asprintf(&s,
-	    "X-Amz-Algorithm=AWS4-HMAC-SHA256&"
-	    "X-Amz-Credential=%s%%2F%s%%2F%s%%2F%s%%2Faws4_request&"
-	    "X-Amz-Date=%s&"
-	    "X-Amz-Expires=%d&"
-	    "X-Amz-SignedHeaders=host&"
-	    "X-Amz-Signature=%s",
-	    key_id, date, region, "s3", datetime, expiry, hhex) == -1)
+err3:
+	free(P->qprefix);
+err2:
+	free(P->creqtail);
+err1:
+	free(P);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * aws_sign_s3_presign_len(P):
+ * Return the length, not including the terminating NUL, of every query
+ * string generated using the state ${P}.
+ */
+size_t
+aws_sign_s3_presign_len(const struct aws_sign_presign * P)
+{
+
+	/* The query parameters are followed by a 64-character signature. */
+	return (P->qprefixlen + 64);
+}
+
+/**
+ * aws_sign_s3_presign(P, method, path, buf):
+ * Write into ${buf} a NUL-terminated query string ${query} such that
+ *   ${method} http://${bucket}.s3.amazonaws.com${path}?${query}
+ * is a correctly signed request, where ${bucket} was passed to
+ * aws_sign_s3_presign_init().  The buffer ${buf} must have space for
+ * aws_sign_s3_presign_len(${P}) + 1 bytes.
+ */
+void
+aws_sign_s3_presign(const struct aws_sign_presign * P, const char * method,
+    const char * path, char * buf)
+{
+	SHA256_CTX sctx;
+	HMAC_SHA256_CTX ctx;
+	uint8_t h_creq[32];
+	char hhex_creq[65];
+	uint8_t hmac[32];
+
+	/* Hash the Canonical Request string. */
+	SHA256_Init(&sctx);
+	SHA256_Update(&sctx, method, strlen(method));
+	SHA256_Update(&sctx, "\n", 1);
+	SHA256_Update(&sctx, path, strlen(path));
+	SHA256_Update(&sctx, "\n", 1);
+	SHA256_Update(&sctx, P->creqtail, P->creqtaillen);
+	SHA256_Final(h_creq, &sctx);
+	hexify(h_creq, hhex_creq, 32);
+
+	/* Finish signing the String to Sign. */
+	memcpy(&ctx, &P->stsctx, sizeof(HMAC_SHA256_CTX));
+	HMAC_SHA256_Update(&ctx, hhex_creq, 64);
+	HMAC_SHA256_Final(hmac, &ctx);
+
+	/* Write out the query parameters and the hexified signature. */
+	memcpy(buf, P->qprefix, P->qprefixlen);
+	hexify(hmac, &buf[P->qprefixlen], 32);
+}
+
+/**
+ * aws_sign_s3_presign_batch(P, methods, paths, n, arena):
+ * For each i in [0, ${n}), write the query string for the request
+ * ${methods[i]} ${paths[i]} into ${arena} at offset
+ * i * (aws_sign_s3_presign_len(${P}) + 1), as aws_sign_s3_presign() does.
+ * Several threads may fill in disjoint parts of an arena at once.
+ */
+void
+aws_sign_s3_presign_batch(const struct aws_sign_presign * P,
+    const char * const * methods, const char * const * paths, size_t n,
+    char * arena)
+{
+	size_t stride = aws_sign_s3_presign_len(P) + 1;
+	size_t i;
+
+	/* Sign each request in turn. */
+	for (i = 0; i < n; i++)
+		aws_sign_s3_presign(P, methods[i], paths[i],
+		    &arena[i * stride]);
+}
+
+/**
+ * aws_sign_s3_presign_free(P):
+ * Free the presigning state ${P}.
+ */
+void
+aws_sign_s3_presign_free(struct aws_sign_presign * P)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (P == NULL)
+		return;
+
+	/* Free strings, and wipe the keyed HMAC context. */
+	free(P->creqtail);
+	free(P->qprefix);
+	insecure_memzero(P, sizeof(struct aws_sign_presign));
+	free(P);
+}
+
+/**
+ * aws_sign_s3_querystr(key_id, key_secret, region, method, bucket, path,
+ *     expiry):
+ * Return a query string ${query} such that
+ *   ${method} http://${bucket}.s3.amazonaws.com${path}?${query}
+ * is a correctly signed request which expires in ${expiry} seconds, assuming
+ * that the ${bucket} S3 bucket is in region ${region}.
+ */
+char *
+aws_sign_s3_querystr(const char * key_id, const char * key_secret,
+    const char * region, const char * method, const char * bucket,
+    const char * path, int expiry)
+{
+	struct aws_sign_presign * P;
+	char * s;
+
+	/* Prepare to sign. */
+	if ((P = aws_sign_s3_presign_init(key_id, key_secret, region, bucket,
+	    expiry, 0)) == NULL)
 		goto err0;
 
+	/* Allocate space for the query string and generate it. */
+	if ((s = malloc(aws_sign_s3_presign_len(P) + 1)) == NULL)
+		goto err1;
+	aws_sign_s3_presign(P, method, path, s);
+
+	/* Clean up. */
+	aws_sign_s3_presign_free(P);
+
 	/* Success! */
 	return (s);
 
 err1:
-	free(s);
+	aws_sign_s3_presign_free(P);
 err0:
 	/* Failure! */
 	return (NULL);
@@ -279,6 +831,7 @@ aws_sign_svc_headers(const char * key_id, const char * key_secret,
     char ** x_amz_content_sha256, char ** x_amz_date, char ** authorization)
 {
 	time_t t_now;
+	struct tm tm_now;
 	char date[9];
 	char datetime[17];
 	uint8_t hbuf[32];
@@ -292,14 +845,20 @@ aws_sign_svc_headers(const char * key_id, const char * key_secret,
 		goto err0;
 	}
 
+	/* Convert to UTC; we may be called from multiple threads. */
+	if (gmtime_r(&t_now, &tm_now) == NULL) {
+		warnp("gmtime_r");
+		goto err0;
+	}
+
 	/* Construct date string <yyyymmdd>. */
-	if (strftime(date, 9, "%Y%m%d", gmtime(&t_now)) == 0) {
+	if (strftime(date, 9, "%Y%m%d", &tm_now) == 0) {
 		warnp("strftime");
 		goto err0;
 	}
 
 	/* Construct date-and-time string <yyyymmddThhmmssZ>. */
-	if (strftime(datetime, 17, "%Y%m%dT%H%M%SZ", gmtime(&t_now)) == 0) {
+	if (strftime(datetime, 17, "%Y%m%dT%H%M%SZ", &tm_now) == 0) {
 		warnp("strftime");
 		goto err0;
 	}
@@ -359,3 +918,18 @@ err0:
 	return (-1);
 }
 
+/**
+ * aws_sign_cleanup(void):
+ * Erase the cached signing keys.  This should be called once no more
+ * requests will be signed.
+ */
+void
+aws_sign_cleanup(void)
+{
+
+	/* Erase the cache, and start filling it from the beginning again. */
+	pthread_mutex_lock(&keycache_mtx);
+	insecure_memzero(keycache, sizeof(keycache));
+	keycache_next = 0;
+	pthread_mutex_unlock(&keycache_mtx);
+}
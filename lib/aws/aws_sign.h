@@ -1,8 +1,20 @@
 #ifndef _AWS_SIGN_
 #define _AWS_SIGN_
 
+#include <stddef.h>
 #include <stdint.h>
 
+/* Opaque types. */
+struct aws_sign_chunked;
+struct aws_sign_presign;
+
+/*
+ * Maximum length of an aws-chunked chunk header, including the terminating
+ * NUL: up to 16 hex digits, ";chunk-signature=", a 64-character signature,
+ * and a CRLF.
+ */
+#define AWS_SIGN_CHUNKHDR_MAX	(16 + 17 + 64 + 2 + 1)
+
 /**
  * aws_sign_s3_headers(key_id, key_secret, region, method, bucket, path,
  *     body, bodylen, x_amz_content_sha256, x_amz_date, authorization):
@@ -22,6 +34,122 @@ int aws_sign_s3_headers(const char *, const char *, const char *,
     const char *, const char *, const char *, const uint8_t *, size_t,
     char **, char **, char **);
 
+/**
+ * aws_sign_s3_headers_prehashed(key_id, key_secret, region, method, bucket,
+ *     path, content_sha256, checksum_crc32c, x_amz_content_sha256,
+ *     x_amz_date, authorization):
+ * As aws_sign_s3_headers(), except that instead of being given the request
+ * body, the caller provides ${content_sha256}, the hexified SHA256 of the
+ * body, or "UNSIGNED-PAYLOAD" if the body should not be covered by the
+ * signature.  This allows a body to be hashed once and signed repeatedly.
+ * If ${checksum_crc32c} is not NULL, the request must also include
+ *   X-Amz-Checksum-CRC32C: ${checksum_crc32c}
+ * which is covered by the signature.
+ */
+int aws_sign_s3_headers_prehashed(const char *, const char *, const char *,
+    const char *, const char *, const char *, const char *, const char *,
+    char **, char **, char **);
+
+/**
+ * aws_sign_s3_chunked_init(key_id, key_secret, region, method, bucket, path,
+ *     decodedlen, x_amz_date, authorization):
+ * Return state for signing a ${decodedlen}-byte request body sent using
+ * aws-chunked encoding, and values ${x_amz_date} and ${authorization} such
+ * that
+ *   ${method} ${path} HTTP/1.1
+ *   Host: ${bucket}.s3.amazonaws.com
+ *   X-Amz-Date: ${x_amz_date}
+ *   X-Amz-Content-SHA256: STREAMING-AWS4-HMAC-SHA256-PAYLOAD
+ *   X-Amz-Decoded-Content-Length: ${decodedlen}
+ *   Content-Encoding: aws-chunked
+ *   Authorization: ${authorization}
+ *   Content-Length: <aws_sign_s3_chunked_len(${decodedlen}, chunklen)>
+ * followed by the body in chunks of ${chunklen} bytes (except that the last
+ * may be shorter), each preceded by the header from aws_sign_s3_chunked()
+ * and followed by "\r\n", and then by an empty chunk in the same manner, is
+ * a correctly signed request to the ${region} S3 region.  All chunks except
+ * the last two must be at least 8192 bytes long.
+ */
+struct aws_sign_chunked * aws_sign_s3_chunked_init(const char *,
+    const char *, const char *, const char *, const char *, const char *,
+    uint64_t, char **, char **);
+
+/**
+ * aws_sign_s3_chunked_len(decodedlen, chunklen):
+ * Return the length of a ${decodedlen}-byte body in aws-chunked encoding,
+ * when it is sent in chunks of ${chunklen} bytes as described above.
+ */
+uint64_t aws_sign_s3_chunked_len(uint64_t, size_t);
+
+/**
+ * aws_sign_s3_chunked(S, buf, len, hdr):
+ * Sign the next ${len}-byte chunk ${buf} of the body using the state ${S},
+ * and write the header which must precede it to ${hdr}.  The body must be
+ * terminated by a chunk with ${len} = 0.
+ */
+void aws_sign_s3_chunked(struct aws_sign_chunked *, const uint8_t *, size_t,
+    char[AWS_SIGN_CHUNKHDR_MAX]);
+
+/**
+ * aws_sign_s3_chunked_rewind(S):
+ * Reset the state ${S} so that the body can be signed again from its first
+ * chunk, e.g., in order to resend the request.
+ */
+void aws_sign_s3_chunked_rewind(struct aws_sign_chunked *);
+
+/**
+ * aws_sign_s3_chunked_free(S):
+ * Free the chunk-signing state ${S}.
+ */
+void aws_sign_s3_chunked_free(struct aws_sign_chunked *);
+
+/**
+ * aws_sign_s3_presign_init(key_id, key_secret, region, bucket, expiry,
+ *     xmlesc):
+ * Prepare to generate query strings for presigned requests to the ${bucket}
+ * S3 bucket in region ${region}, which expire in ${expiry} seconds.  All of
+ * the query strings share a single timestamp.  If ${xmlesc} is non-zero, the
+ * '&' characters separating query parameters are written as "&amp;" so that
+ * the query strings can be embedded in XML.  The returned state is not
+ * modified by aws_sign_s3_presign() and may be used by multiple threads.
+ */
+struct aws_sign_presign * aws_sign_s3_presign_init(const char *,
+    const char *, const char *, const char *, int, int);
+
+/**
+ * aws_sign_s3_presign_len(P):
+ * Return the length, not including the terminating NUL, of every query
+ * string generated using the state ${P}.
+ */
+size_t aws_sign_s3_presign_len(const struct aws_sign_presign *);
+
+/**
+ * aws_sign_s3_presign(P, method, path, buf):
+ * Write into ${buf} a NUL-terminated query string ${query} such that
+ *   ${method} http://${bucket}.s3.amazonaws.com${path}?${query}
+ * is a correctly signed request, where ${bucket} was passed to
+ * aws_sign_s3_presign_init().  The buffer ${buf} must have space for
+ * aws_sign_s3_presign_len(${P}) + 1 bytes.
+ */
+void aws_sign_s3_presign(const struct aws_sign_presign *, const char *,
+    const char *, char *);
+
+/**
+ * aws_sign_s3_presign_batch(P, methods, paths, n, arena):
+ * For each i in [0, ${n}), write the query string for the request
+ * ${methods[i]} ${paths[i]} into ${arena} at offset
+ * i * (aws_sign_s3_presign_len(${P}) + 1), as aws_sign_s3_presign() does.
+ * Several threads may fill in disjoint parts of an arena at once.
+ */
+void aws_sign_s3_presign_batch(const struct aws_sign_presign *,
+    const char * const *, const char * const *, size_t, char *);
+
+/**
+ * aws_sign_s3_presign_free(P):
+ * Free the presigning state ${P}.
+ */
+void aws_sign_s3_presign_free(struct aws_sign_presign *);
+
 /**
  * aws_sign_s3_querystr(key_id, key_secret, region, method, bucket, path,
  *     expiry):
@@ -56,4 +184,11 @@ int aws_sign_svc_headers(const char *, const char *, const char *,
 #define aws_sign_sns_headers(a, b, c, d, e, f, g, h) \
     aws_sign_svc_headers(a, b, c, "sns", d, e, f, g, h)
 
+/**
+ * aws_sign_cleanup(void):
+ * Erase the cached signing keys.  This should be called once no more
+ * requests will be signed.
+ */
+void aws_sign_cleanup(void);
+
 #endif /* !_AWS_SIGN_ */
@@ -0,0 +1,302 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aws_sign.h"
+#include "hexify.h"
+#include "warnp.h"
+
+#include "ec2_manifest.h"
+
+/*
+ * The manifest is generated in two passes using the same code: first with
+ * ${buf} set to NULL, in order to count the bytes required; and then into a
+ * buffer of exactly that size.
+ */
+struct mwriter {
+	char * buf;
+	size_t pos;
+	const struct aws_sign_presign * P;
+	size_t qlen;
+	char * arena;
+};
+
+/* Add ${len} bytes from ${s} to the manifest. */
+static void
+w_mem(struct mwriter * W, const char * s, size_t len)
+{
+
+	if (W->buf != NULL)
+		memcpy(&W->buf[W->pos], s, len);
+	W->pos += len;
+}
+
+/* Add the string ${s} to the manifest. */
+static void
+w_str(struct mwriter * W, const char * s)
+{
+
+	w_mem(W, s, strlen(s));
+}
+
+/* Add the string ${s} to the manifest, escaping it for XML. */
+static void
+w_xml(struct mwriter * W, const char * s)
+{
+
+	for (; *s != '\0'; s++) {
+		switch (*s) {
+		case '&':
+			w_mem(W, "&amp;", 5);
+			break;
+		case '<':
+			w_mem(W, "&lt;", 4);
+			break;
+		case '>':
+			w_mem(W, "&gt;", 4);
+			break;
+		case '"':
+			w_mem(W, "&quot;", 6);
+			break;
+		case '\'':
+			w_mem(W, "&apos;", 6);
+			break;
+		default:
+			w_mem(W, s, 1);
+			break;
+		}
+	}
+}
+
+/* Add the decimal representation of ${x} to the manifest. */
+static void
+w_u64(struct mwriter * W, uint64_t x)
+{
+	char tmp[20];
+	size_t i = sizeof(tmp);
+
+	/* Generate digits from the right. */
+	do {
+		tmp[--i] = '0' + (x % 10);
+		x /= 10;
+	} while (x > 0);
+
+	w_mem(W, &tmp[i], sizeof(tmp) - i);
+}
+
+/*
+ * Sign the ${n} requests ${methods}[i] ${paths}[i] into the arena, unless
+ * we're only counting bytes.
+ */
+static void
+w_sign(struct mwriter * W, const char * const * methods,
+    const char * const * paths, size_t n)
+{
+
+	if (W->buf != NULL)
+		aws_sign_s3_presign_batch(W->P, methods, paths, n, W->arena);
+}
+
+/*
+ * Add the presigned URL for ${path} in ${bucket} which is in slot ${i} of
+ * the arena, wrapped in <${tag}> and </${tag}>, to the manifest.
+ */
+static void
+w_url(struct mwriter * W, const char * tag, const char * bucket,
+    const char * path, size_t i)
+{
+
+	w_str(W, "<");
+	w_str(W, tag);
+	w_str(W, ">https://");
+	w_xml(W, bucket);
+	w_str(W, ".s3.amazonaws.com");
+	w_xml(W, path);
+	w_str(W, "?");
+
+	/* The query string has a fixed length and is already escaped. */
+	w_mem(W, &W->arena[i * (W->qlen + 1)], W->qlen);
+
+	w_str(W, "</");
+	w_str(W, tag);
+	w_str(W, ">");
+}
+
+/*
+ * Add the entire manifest, using ${path} and ${dpath}, each of ${pathlen}
+ * bytes, as scratch space.
+ */
+static void
+w_manifest(struct mwriter * W, const char * bucket, const char * prefix,
+    uint64_t size, uint64_t partsz, const uint8_t * zeroparts,
+    const uint8_t * hashes, char * path, char * dpath, size_t pathlen)
+{
+	static const char * const selfdestruct[1] = {"DELETE"};
+	static const char * const partmethods[3] = {"HEAD", "GET", "DELETE"};
+	const char * paths[3] = {path, path, path};
+	char hashhex[65];
+	uint64_t nparts = (size + partsz - 1) / partsz;
+	uint64_t partnum;
+	uint64_t pos;
+	uint64_t end;
+
+	/* Start of the manifest, up to and including the self-destruct URL. */
+	w_str(W,
+	    "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>"
+	    "<manifest>"
+		"<version>2010-11-15</version>"
+		"<file-format>RAW</file-format>"
+		"<importer>"
+		    "<name>bsdec2-image-upload</name>"
+		    "<version>1.2.2</version>"
+		    "<release>2019-03-20</release>"
+		"</importer>");
+	snprintf(path, pathlen, "/%s/manifest.xml", prefix);
+	w_sign(W, selfdestruct, paths, 1);
+	w_url(W, "self-destruct-url", bucket, path, 0);
+
+	/* Image and volume sizes, and the number of parts. */
+	w_str(W, "<import><size>");
+	w_u64(W, size);
+	w_str(W, "</size><volume-size>");
+	w_u64(W, (size + (1 << 30) - 1) / (1 << 30));
+	w_str(W, "</volume-size><parts count=\"");
+	w_u64(W, nparts);
+	w_str(W, "\">");
+
+	/* The parts, in order. */
+	for (partnum = 0; partnum < nparts; partnum++) {
+		/* Figure out where this part is; the last may be short. */
+		pos = partnum * partsz;
+		end = (size - pos < partsz) ? size : pos + partsz;
+
+		/*
+		 * Index, byte range, and key; zero parts share an object, and
+		 * parts stored by content are named after their hashes.
+		 */
+		w_str(W, "<part index=\"");
+		w_u64(W, partnum);
+		w_str(W, "\"><byte-range start=\"");
+		w_u64(W, pos);
+		w_str(W, "\" end=\"");
+		w_u64(W, end - 1);
+		w_str(W, "\"/><key>");
+		if (hashes != NULL) {
+			hexify(&hashes[partnum * 32], hashhex, 32);
+			w_str(W, "sha256/");
+			w_str(W, hashhex);
+			snprintf(path, pathlen, "/sha256/%s", hashhex);
+		} else if ((zeroparts != NULL) && zeroparts[partnum]) {
+			w_xml(W, prefix);
+			w_str(W, "/zero");
+			snprintf(path, pathlen, "/%s/zero", prefix);
+		} else {
+			w_xml(W, prefix);
+			w_str(W, "/part");
+			w_u64(W, partnum);
+			snprintf(path, pathlen, "/%s/part%" PRIu64, prefix,
+			    partnum);
+		}
+		w_str(W, "</key>");
+
+		/*
+		 * Objects stored by content may be shared with other images,
+		 * so they must not be deleted when this import is cleaned up.
+		 * Point the delete URL at an object which we never create.
+		 */
+		if (hashes != NULL) {
+			snprintf(dpath, pathlen, "/%s/part%" PRIu64, prefix,
+			    partnum);
+			paths[2] = dpath;
+		}
+
+		/* Presigned URLs, signed together. */
+		w_sign(W, partmethods, paths, 3);
+		w_url(W, "head-url", bucket, paths[0], 0);
+		w_url(W, "get-url", bucket, paths[1], 1);
+		w_url(W, "delete-url", bucket, paths[2], 2);
+		w_str(W, "</part>");
+	}
+
+	/* End of the manifest. */
+	w_str(W, "</parts></import></manifest>");
+}
+
+/**
+ * ec2_manifest(P, bucket, prefix, size, partsz, zeroparts, hashes, len):
+ * Construct an EC2 import manifest for a ${size}-byte RAW disk image which
+ * has been uploaded to the S3 bucket ${bucket} as objects ${prefix}/part0,
+ * ${prefix}/part1, ... of ${partsz} bytes each (the last may be shorter),
+ * and which will itself be stored as ${prefix}/manifest.xml.  If
+ * ${zeroparts} is not NULL, each part i for which ${zeroparts}[i] is
+ * non-zero is all zeroes, and was uploaded only once, as ${prefix}/zero.
+ * If ${hashes} is not NULL, it holds the 32-byte SHA256 of each part, and
+ * the parts were instead uploaded as sha256/<hexified hash>; since other
+ * images may share those objects, the manifest's delete URLs then point at
+ * ${prefix}/part<i>, which do not exist, rather than at them.  Presigned
+ * URLs are generated using ${P}, which must have been created for ${bucket}
+ * with XML escaping enabled.  Return the NUL-terminated manifest and set
+ * ${len} to its length.
+ */
+char *
+ec2_manifest(const struct aws_sign_presign * P, const char * bucket,
+    const char * prefix, uint64_t size, uint64_t partsz,
+    const uint8_t * zeroparts, const uint8_t * hashes, size_t * len)
+{
+	struct mwriter W;
+	char * path;
+	size_t pathlen;
+
+	/* Sanity-check. */
+	if (partsz == 0) {
+		warn0("Parts must be non-empty");
+		goto err0;
+	}
+
+	/* Allocate space for two of the longest path we will sign. */
+	pathlen = strlen(prefix) + 27;
+	if (pathlen < 73)
+		pathlen = 73;
+	if ((path = malloc(2 * pathlen)) == NULL)
+		goto err0;
+
+	/* Allocate space for the query strings of one part's URLs. */
+	W.qlen = aws_sign_s3_presign_len(P);
+	if ((W.arena = malloc(3 * (W.qlen + 1))) == NULL)
+		goto err1;
+
+	/* Count the bytes in the manifest. */
+	W.buf = NULL;
+	W.pos = 0;
+	W.P = P;
+	w_manifest(&W, bucket, prefix, size, partsz, zeroparts, hashes,
+	    path, &path[pathlen], pathlen);
+
+	/* Allocate a buffer of exactly the right size, plus a NUL. */
+	*len = W.pos;
+	if ((W.buf = malloc(*len + 1)) == NULL)
+		goto err2;
+
+	/* Write the manifest. */
+	W.pos = 0;
+	w_manifest(&W, bucket, prefix, size, partsz, zeroparts, hashes,
+	    path, &path[pathlen], pathlen);
+	W.buf[*len] = '\0';
+
+	/* Free the arena and the path buffer. */
+	free(W.arena);
+	free(path);
+
+	/* Success! */
+	return (W.buf);
+
+err2:
+	free(W.arena);
+err1:
+	free(path);
+err0:
+	/* Failure! */
+	return (NULL);
+}
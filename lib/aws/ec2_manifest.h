@@ -0,0 +1,30 @@
+#ifndef _EC2_MANIFEST_H_
+#define _EC2_MANIFEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Opaque type. */
+struct aws_sign_presign;
+
+/**
+ * ec2_manifest(P, bucket, prefix, size, partsz, zeroparts, hashes, len):
+ * Construct an EC2 import manifest for a ${size}-byte RAW disk image which
+ * has been uploaded to the S3 bucket ${bucket} as objects ${prefix}/part0,
+ * ${prefix}/part1, ... of ${partsz} bytes each (the last may be shorter),
+ * and which will itself be stored as ${prefix}/manifest.xml.  If
+ * ${zeroparts} is not NULL, each part i for which ${zeroparts}[i] is
+ * non-zero is all zeroes, and was uploaded only once, as ${prefix}/zero.
+ * If ${hashes} is not NULL, it holds the 32-byte SHA256 of each part, and
+ * the parts were instead uploaded as sha256/<hexified hash>; since other
+ * images may share those objects, the manifest's delete URLs then point at
+ * ${prefix}/part<i>, which do not exist, rather than at them.  Presigned
+ * URLs are generated using ${P}, which must have been created for ${bucket}
+ * with XML escaping enabled.  Return the NUL-terminated manifest and set
+ * ${len} to its length.
+ */
+char * ec2_manifest(const struct aws_sign_presign *, const char *,
+    const char *, uint64_t, uint64_t, const uint8_t *, const uint8_t *,
+    size_t *);
+
+#endif /* !_EC2_MANIFEST_H_ */
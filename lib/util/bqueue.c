@@ -0,0 +1,244 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "warnp.h"
+
+#include "bqueue.h"
+
+/* A bounded queue, stored as a ring buffer. */
+struct bqueue {
+	void ** items;
+	size_t maxlen;
+	size_t head;
+	size_t len;
+	int closed;
+	pthread_mutex_t mtx;
+	pthread_cond_t notempty;
+	pthread_cond_t notfull;
+};
+
+/**
+ * bqueue_init(maxlen):
+ * Create a queue which can hold up to ${maxlen} items and which can be
+ * used to pass items between threads.
+ */
+struct bqueue *
+bqueue_init(size_t maxlen)
+{
+	struct bqueue * Q;
+	int rc;
+
+	/* Sanity-check. */
+	if (maxlen == 0) {
+		warn0("Queues must be able to hold at least one item");
+		goto err0;
+	}
+
+	/* Allocate the queue and its ring buffer. */
+	if ((Q = malloc(sizeof(struct bqueue))) == NULL)
+		goto err0;
+	if ((Q->items = malloc(maxlen * sizeof(void *))) == NULL)
+		goto err1;
+	Q->maxlen = maxlen;
+	Q->head = 0;
+	Q->len = 0;
+	Q->closed = 0;
+
+	/* Initialize the lock and condition variables. */
+	if ((rc = pthread_mutex_init(&Q->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err2;
+	}
+	if ((rc = pthread_cond_init(&Q->notempty, NULL)) != 0) {
+		warn0("pthread_cond_init: %s", strerror(rc));
+		goto err3;
+	}
+	if ((rc = pthread_cond_init(&Q->notfull, NULL)) != 0) {
+		warn0("pthread_cond_init: %s", strerror(rc));
+		goto err4;
+	}
+
+	/* Success! */
+	return (Q);
+
+err4:
+	pthread_cond_destroy(&Q->notempty);
+err3:
+	pthread_mutex_destroy(&Q->mtx);
+err2:
+	free(Q->items);
+err1:
+	free(Q);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * bqueue_put(Q, item):
+ * Add ${item} to the queue ${Q}, waiting until there is space for it.
+ * Return 0 on success, 1 if the queue has been closed, or -1 on error.
+ */
+int
+bqueue_put(struct bqueue * Q, void * item)
+{
+	int rc;
+
+	/* Lock the queue. */
+	if ((rc = pthread_mutex_lock(&Q->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Wait until there is space or the queue is closed. */
+	while ((Q->len == Q->maxlen) && !Q->closed) {
+		if ((rc = pthread_cond_wait(&Q->notfull, &Q->mtx)) != 0) {
+			warn0("pthread_cond_wait: %s", strerror(rc));
+			goto err1;
+		}
+	}
+
+	/* We can't add items to a closed queue. */
+	if (Q->closed) {
+		pthread_mutex_unlock(&Q->mtx);
+		return (1);
+	}
+
+	/* Add the item and wake up a thread waiting for one. */
+	Q->items[(Q->head + Q->len) % Q->maxlen] = item;
+	Q->len++;
+	if ((rc = pthread_cond_signal(&Q->notempty)) != 0) {
+		warn0("pthread_cond_signal: %s", strerror(rc));
+		goto err1;
+	}
+
+	/* Unlock the queue. */
+	if ((rc = pthread_mutex_unlock(&Q->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	pthread_mutex_unlock(&Q->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * bqueue_get(Q, item):
+ * Remove the oldest item from the queue ${Q} and return it via ${item},
+ * waiting until there is one.  Return 0 on success, 1 if the queue has been
+ * closed and is empty, or -1 on error.
+ */
+int
+bqueue_get(struct bqueue * Q, void ** item)
+{
+	size_t nitems;
+
+	return (bqueue_getmany(Q, item, 1, &nitems));
+}
+
+/**
+ * bqueue_getmany(Q, items, maxitems, nitems):
+ * Remove up to ${maxitems} of the oldest items from the queue ${Q} and
+ * return them via ${items}, setting ${nitems} to the number removed.  Wait
+ * until there is at least one item, but not for any more.  Return 0 on
+ * success, 1 if the queue has been closed and is empty, or -1 on error.
+ */
+int
+bqueue_getmany(struct bqueue * Q, void ** items, size_t maxitems,
+    size_t * nitems)
+{
+	int rc;
+
+	/* Lock the queue. */
+	if ((rc = pthread_mutex_lock(&Q->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Wait until there is an item or the queue is closed. */
+	while ((Q->len == 0) && !Q->closed) {
+		if ((rc = pthread_cond_wait(&Q->notempty, &Q->mtx)) != 0) {
+			warn0("pthread_cond_wait: %s", strerror(rc));
+			goto err1;
+		}
+	}
+
+	/* Nothing more is coming? */
+	if (Q->len == 0) {
+		pthread_mutex_unlock(&Q->mtx);
+		return (1);
+	}
+
+	/* Remove as many items as we can. */
+	for (*nitems = 0; (*nitems < maxitems) && (Q->len > 0); (*nitems)++) {
+		items[*nitems] = Q->items[Q->head];
+		Q->head = (Q->head + 1) % Q->maxlen;
+		Q->len--;
+	}
+
+	/* Wake up threads waiting for space. */
+	if ((rc = pthread_cond_broadcast(&Q->notfull)) != 0) {
+		warn0("pthread_cond_broadcast: %s", strerror(rc));
+		goto err1;
+	}
+
+	/* Unlock the queue. */
+	if ((rc = pthread_mutex_unlock(&Q->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	pthread_mutex_unlock(&Q->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * bqueue_close(Q):
+ * Close the queue ${Q}: further bqueue_put() calls fail, while bqueue_get()
+ * returns the items remaining in the queue and then reports that the queue
+ * is closed.  Threads waiting on the queue are woken up.
+ */
+void
+bqueue_close(struct bqueue * Q)
+{
+
+	/* Mark the queue as closed and wake everybody up. */
+	pthread_mutex_lock(&Q->mtx);
+	Q->closed = 1;
+	pthread_cond_broadcast(&Q->notempty);
+	pthread_cond_broadcast(&Q->notfull);
+	pthread_mutex_unlock(&Q->mtx);
+}
+
+/**
+ * bqueue_free(Q):
+ * Free the queue ${Q}.  No threads may be waiting on the queue.
+ */
+void
+bqueue_free(struct bqueue * Q)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (Q == NULL)
+		return;
+
+	/* Free the synchronization primitives, ring buffer, and queue. */
+	pthread_cond_destroy(&Q->notfull);
+	pthread_cond_destroy(&Q->notempty);
+	pthread_mutex_destroy(&Q->mtx);
+	free(Q->items);
+	free(Q);
+}
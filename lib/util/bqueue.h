@@ -0,0 +1,54 @@
+#ifndef _BQUEUE_H_
+#define _BQUEUE_H_
+
+#include <stddef.h>
+
+/* Opaque type. */
+struct bqueue;
+
+/**
+ * bqueue_init(maxlen):
+ * Create a queue which can hold up to ${maxlen} items and which can be
+ * used to pass items between threads.
+ */
+struct bqueue * bqueue_init(size_t);
+
+/**
+ * bqueue_put(Q, item):
+ * Add ${item} to the queue ${Q}, waiting until there is space for it.
+ * Return 0 on success, 1 if the queue has been closed, or -1 on error.
+ */
+int bqueue_put(struct bqueue *, void *);
+
+/**
+ * bqueue_get(Q, item):
+ * Remove the oldest item from the queue ${Q} and return it via ${item},
+ * waiting until there is one.  Return 0 on success, 1 if the queue has been
+ * closed and is empty, or -1 on error.
+ */
+int bqueue_get(struct bqueue *, void **);
+
+/**
+ * bqueue_getmany(Q, items, maxitems, nitems):
+ * Remove up to ${maxitems} of the oldest items from the queue ${Q} and
+ * return them via ${items}, setting ${nitems} to the number removed.  Wait
+ * until there is at least one item, but not for any more.  Return 0 on
+ * success, 1 if the queue has been closed and is empty, or -1 on error.
+ */
+int bqueue_getmany(struct bqueue *, void **, size_t, size_t *);
+
+/**
+ * bqueue_close(Q):
+ * Close the queue ${Q}: further bqueue_put() calls fail, while bqueue_get()
+ * returns the items remaining in the queue and then reports that the queue
+ * is closed.  Threads waiting on the queue are woken up.
+ */
+void bqueue_close(struct bqueue *);
+
+/**
+ * bqueue_free(Q):
+ * Free the queue ${Q}.  No threads may be waiting on the queue.
+ */
+void bqueue_free(struct bqueue *);
+
+#endif /* !_BQUEUE_H_ */
@@ -0,0 +1,220 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hexify.h"
+#include "warnp.h"
+
+#include "hashindex.h"
+
+struct hashindex {
+	char * fname;
+	FILE * f;
+	uint8_t (* hashes)[32];
+	size_t nhashes;
+	pthread_mutex_t mtx;
+};
+
+/* Compare two hashes, for qsort and bsearch. */
+static int
+hashcmp(const void * a, const void * b)
+{
+
+	return (memcmp(a, b, 32));
+}
+
+/* Load the hashes from ${H->fname}, if it exists, and sort them. */
+static int
+load(struct hashindex * H)
+{
+	FILE * f;
+	char * line = NULL;
+	size_t linecap = 0;
+	size_t maxhashes = 0;
+	void * p;
+
+	/* Open the file, if it exists. */
+	if ((f = fopen(H->fname, "r")) == NULL) {
+		if (errno == ENOENT) {
+			errno = 0;
+			return (0);
+		}
+		warnp("fopen(%s)", H->fname);
+		goto err0;
+	}
+
+	/* Each line is a hexified hash; ignore anything else. */
+	while (getline(&line, &linecap, f) != -1) {
+		/* Grow the array if needed. */
+		if (H->nhashes == maxhashes) {
+			maxhashes = maxhashes ? maxhashes * 2 : 1024;
+			if ((p = realloc(H->hashes, maxhashes * 32)) == NULL)
+				goto err1;
+			H->hashes = p;
+		}
+
+		/* Parse the hash. */
+		if ((strspn(line, "0123456789abcdef") != 64) ||
+		    unhexify(line, H->hashes[H->nhashes], 32))
+			continue;
+		H->nhashes++;
+	}
+
+	/* Check for error. */
+	if (ferror(f)) {
+		warnp("Error reading %s", H->fname);
+		goto err1;
+	}
+
+	/* Sort the hashes so that we can search them. */
+	if (H->nhashes > 0)
+		qsort(H->hashes, H->nhashes, 32, hashcmp);
+
+	/* Clean up. */
+	free(line);
+	fclose(f);
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(line);
+	fclose(f);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * hashindex_open(fname):
+ * Load the SHA256 hashes recorded in the index file ${fname}, one hexified
+ * hash per line, and open the file for recording more.  A missing file is
+ * treated as empty.
+ */
+struct hashindex *
+hashindex_open(const char * fname)
+{
+	struct hashindex * H;
+	int rc;
+
+	/* Allocate a structure. */
+	if ((H = malloc(sizeof(struct hashindex))) == NULL)
+		goto err0;
+	if ((H->fname = strdup(fname)) == NULL)
+		goto err1;
+	H->hashes = NULL;
+	H->nhashes = 0;
+
+	/* Load the hashes we already know about. */
+	if (load(H))
+		goto err2;
+
+	/* Open the file for appending. */
+	if ((H->f = fopen(fname, "a")) == NULL) {
+		warnp("fopen(%s)", fname);
+		goto err2;
+	}
+
+	/* Initialize the lock. */
+	if ((rc = pthread_mutex_init(&H->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err3;
+	}
+
+	/* Success! */
+	return (H);
+
+err3:
+	fclose(H->f);
+err2:
+	free(H->hashes);
+	free(H->fname);
+err1:
+	free(H);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * hashindex_has(H, hash):
+ * Return non-zero if the 32-byte ${hash} was in the index ${H} when it was
+ * opened.  This may be called by multiple threads.
+ */
+int
+hashindex_has(const struct hashindex * H, const uint8_t hash[32])
+{
+
+	/* The array is not modified after loading, so no locking needed. */
+	if (H->nhashes == 0)
+		return (0);
+	return (bsearch(hash, H->hashes, H->nhashes, 32, hashcmp) != NULL);
+}
+
+/**
+ * hashindex_add(H, hash):
+ * Append the 32-byte ${hash} to the index file for ${H}.  Hashes added this
+ * way are not visible via hashindex_has() until the index is reopened.  This
+ * may be called by multiple threads.  Return 0 on success or -1 on error.
+ */
+int
+hashindex_add(struct hashindex * H, const uint8_t hash[32])
+{
+	char hashhex[65];
+	int rc;
+
+	/* Hexify the hash. */
+	hexify(hash, hashhex, 32);
+
+	/* Write a line, and push it out so that it survives if we crash. */
+	if ((rc = pthread_mutex_lock(&H->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+	if ((fprintf(H->f, "%s\n", hashhex) < 0) || fflush(H->f)) {
+		warnp("Error writing %s", H->fname);
+		goto err1;
+	}
+	pthread_mutex_unlock(&H->mtx);
+
+	/* Success! */
+	return (0);
+
+err1:
+	pthread_mutex_unlock(&H->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * hashindex_close(H):
+ * Close the index ${H}.  Return 0 on success or -1 if recorded hashes may
+ * not have been written out.
+ */
+int
+hashindex_close(struct hashindex * H)
+{
+	int rc = 0;
+
+	/* Behave consistently with free(NULL). */
+	if (H == NULL)
+		return (0);
+
+	/* Close the file. */
+	if (fclose(H->f)) {
+		warnp("fclose(%s)", H->fname);
+		rc = -1;
+	}
+
+	/* Free everything. */
+	pthread_mutex_destroy(&H->mtx);
+	free(H->hashes);
+	free(H->fname);
+	free(H);
+
+	return (rc);
+}
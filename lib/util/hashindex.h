@@ -0,0 +1,39 @@
+#ifndef _HASHINDEX_H_
+#define _HASHINDEX_H_
+
+#include <stdint.h>
+
+/* Opaque type. */
+struct hashindex;
+
+/**
+ * hashindex_open(fname):
+ * Load the SHA256 hashes recorded in the index file ${fname}, one hexified
+ * hash per line, and open the file for recording more.  A missing file is
+ * treated as empty.
+ */
+struct hashindex * hashindex_open(const char *);
+
+/**
+ * hashindex_has(H, hash):
+ * Return non-zero if the 32-byte ${hash} was in the index ${H} when it was
+ * opened.  This may be called by multiple threads.
+ */
+int hashindex_has(const struct hashindex *, const uint8_t[32]);
+
+/**
+ * hashindex_add(H, hash):
+ * Append the 32-byte ${hash} to the index file for ${H}.  Hashes added this
+ * way are not visible via hashindex_has() until the index is reopened.  This
+ * may be called by multiple threads.  Return 0 on success or -1 on error.
+ */
+int hashindex_add(struct hashindex *, const uint8_t[32]);
+
+/**
+ * hashindex_close(H):
+ * Close the index ${H}.  Return 0 on success or -1 if recorded hashes may
+ * not have been written out.
+ */
+int hashindex_close(struct hashindex *);
+
+#endif /* !_HASHINDEX_H_ */
@@ -0,0 +1,501 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#include "elasticarray.h"
+
+#include "httpresp.h"
+
+/* Maximum length of a status line, header line, or chunk-size line. */
+#define MAXLINE		65536
+
+/* Maximum number of header lines. */
+#define MAXHEADERS	256
+
+/* Elastic byte buffer type. */
+ELASTICARRAY_DECL(BYTES, bytes, uint8_t);
+
+/* Buffered reader state. */
+struct reader {
+	ssize_t (* readfunc)(void *, uint8_t *, size_t);
+	void * cookie;
+	uint8_t buf[4096];
+	size_t pos;
+	size_t len;
+	int * gotresp;
+};
+
+/*
+ * Make sure that there are buffered bytes in ${R}.  Return 1 if there are,
+ * 0 on EOF, or -1 on error.
+ */
+static int
+rd_fill(struct reader * R)
+{
+	ssize_t lenread;
+
+	/* If we have buffered data, we're good. */
+	if (R->pos < R->len)
+		return (1);
+
+	/* Read some more. */
+	if ((lenread = (R->readfunc)(R->cookie, R->buf, sizeof(R->buf))) < 0)
+		return (-1);
+	if (lenread == 0)
+		return (0);
+	R->pos = 0;
+	R->len = (size_t)lenread;
+	*R->gotresp = 1;
+
+	/* We have data. */
+	return (1);
+}
+
+/*
+ * Read a CRLF- or LF-terminated line from ${R} and append it, with a
+ * terminating NUL in place of the EOL, to ${line}.  Return NULL on success
+ * or an error string.
+ */
+static const char *
+rd_line(struct reader * R, BYTES line)
+{
+	size_t start = bytes_getsize(line);
+	uint8_t * eol;
+	size_t n;
+	int rc;
+
+	do {
+		/* Get some data. */
+		if ((rc = rd_fill(R)) == -1)
+			return ("Could not read response");
+		if (rc == 0)
+			return (*R->gotresp ? "Truncated response" :
+			    "Connection closed");
+
+		/* Append data up to and including the EOL, if we see one. */
+		eol = memchr(&R->buf[R->pos], '\n', R->len - R->pos);
+		n = (eol != NULL) ? (size_t)(eol - &R->buf[R->pos]) + 1 :
+		    R->len - R->pos;
+		if (bytes_getsize(line) - start + n > MAXLINE)
+			return ("Response line too long");
+		if (bytes_append(line, &R->buf[R->pos], n))
+			return ("Out of memory");
+		R->pos += n;
+	} while (eol == NULL);
+
+	/* Replace the LF (and a preceding CR) with a NUL. */
+	n = bytes_getsize(line);
+	bytes_shrink(line, 1);
+	if ((n - 1 > start) && (*bytes_get(line, n - 2) == '\r'))
+		bytes_shrink(line, 1);
+	if (bytes_append(line, (const uint8_t *)"", 1))
+		return ("Out of memory");
+
+	/* Success! */
+	return (NULL);
+}
+
+/*
+ * Read ${len} bytes from ${R} and append them to ${body}.  If ${toeof} is
+ * non-zero, instead read until EOF.  Return NULL on success or an error
+ * string.
+ */
+static const char *
+rd_body(struct reader * R, BYTES body, size_t len, int toeof)
+{
+	size_t bodypos = bytes_getsize(body);
+	size_t n;
+	ssize_t lenread;
+
+	/* Use up any buffered data first. */
+	n = R->len - R->pos;
+	if (!toeof && (n > len))
+		n = len;
+	if (bytes_append(body, &R->buf[R->pos], n))
+		return ("Out of memory");
+	R->pos += n;
+	bodypos += n;
+	len -= toeof ? 0 : n;
+
+	/* Read the rest directly into the body buffer. */
+	while (toeof || (len > 0)) {
+		/* Make space; if reading until EOF, grab a buffer's worth. */
+		n = toeof ? sizeof(R->buf) : len;
+		if (bytes_resize(body, bodypos + n))
+			return ("Out of memory");
+
+		/* Read data. */
+		if ((lenread = (R->readfunc)(R->cookie,
+		    bytes_get(body, bodypos), n)) <= 0) {
+			bytes_shrink(body, n);
+			if ((lenread == 0) && toeof)
+				break;
+			return ((lenread == 0) ? "Truncated response" :
+			    "Could not read response");
+		}
+		*R->gotresp = 1;
+
+		/* Drop the space we didn't use. */
+		bytes_shrink(body, n - (size_t)lenread);
+		bodypos += (size_t)lenread;
+		len -= toeof ? 0 : (size_t)lenread;
+	}
+
+	/* Success! */
+	return (NULL);
+}
+
+/*
+ * Parse ${len} bytes from ${s} as a number in base ${base}, stopping at the
+ * first character which is not a valid digit.  Return -1 if there are no
+ * digits or the value would overflow.
+ */
+static int
+parsenum(const char * s, size_t len, int base, size_t * val)
+{
+	size_t i;
+	int d;
+
+	for (*val = 0, i = 0; i < len; i++) {
+		if ((s[i] >= '0') && (s[i] <= '9'))
+			d = s[i] - '0';
+		else if ((base == 16) && (s[i] >= 'a') && (s[i] <= 'f'))
+			d = s[i] - 'a' + 10;
+		else if ((base == 16) && (s[i] >= 'A') && (s[i] <= 'F'))
+			d = s[i] - 'A' + 10;
+		else
+			break;
+		if (*val > (SIZE_MAX - (size_t)d) / (size_t)base)
+			return (-1);
+		*val = *val * (size_t)base + (size_t)d;
+	}
+
+	/* We need at least one digit. */
+	return ((i == 0) ? -1 : 0);
+}
+
+/* Does the comma-separated list ${s} contain ${token}? */
+static int
+hastoken(const char * s, const char * token)
+{
+	size_t len;
+
+	while (*s != '\0') {
+		/* Skip separators and whitespace. */
+		s += strspn(s, ", \t");
+
+		/* Compare the next token. */
+		len = strcspn(s, ", \t");
+		if ((len == strlen(token)) && (strncasecmp(s, token, len) == 0))
+			return (1);
+		s += len;
+	}
+
+	/* Not found. */
+	return (0);
+}
+
+/*
+ * Read the status line and headers of a response from ${R} into ${H},
+ * storing the offsets of header names and values in ${offs}.  Return NULL
+ * on success or an error string.
+ */
+static const char *
+rd_headers(struct reader * R, struct httpresp * H, BYTES hdata,
+    size_t offs[MAXHEADERS][2])
+{
+	const char * errstr;
+	char * line;
+	size_t linepos;
+	size_t status;
+	char * colon;
+	char * val;
+	size_t vlen;
+
+	/* Read the status line. */
+	bytes_shrink(hdata, bytes_getsize(hdata));
+	if ((errstr = rd_line(R, hdata)) != NULL)
+		return (errstr);
+	line = (char *)bytes_get(hdata, 0);
+
+	/* Parse "HTTP/1.x NNN reason". */
+	if ((strncmp(line, "HTTP/1.", 7) != 0) || (line[7] == '\0') ||
+	    (line[8] != ' ') || parsenum(&line[9], 3, 10, &status) ||
+	    (status < 100) || (status > 999))
+		return ("Bad HTTP status line");
+	H->status = (int)status;
+
+	/* HTTP/1.1 connections persist unless we're told otherwise. */
+	H->keepalive = (line[7] == '1');
+
+	/* Read header lines until we get a blank line. */
+	for (H->nheaders = 0; ; H->nheaders++) {
+		linepos = bytes_getsize(hdata);
+		if ((errstr = rd_line(R, hdata)) != NULL)
+			return (errstr);
+		line = (char *)bytes_get(hdata, linepos);
+		if (line[0] == '\0')
+			break;
+
+		/* Split the header into name and value. */
+		if ((colon = strchr(line, ':')) == NULL)
+			return ("Bad HTTP header line");
+		if (H->nheaders == MAXHEADERS)
+			return ("Too many HTTP headers");
+		*colon = '\0';
+		val = colon + 1;
+		val += strspn(val, " \t");
+		for (vlen = strlen(val); (vlen > 0) &&
+		    ((val[vlen - 1] == ' ') || (val[vlen - 1] == '\t')); vlen--)
+			val[vlen - 1] = '\0';
+
+		/* Record where the name and value are. */
+		offs[H->nheaders][0] = linepos;
+		offs[H->nheaders][1] = linepos + (size_t)(val - line);
+	}
+
+	/* Success! */
+	return (NULL);
+}
+
+/**
+ * httpresp_read(readfunc, cookie, nobody, resp, gotresp):
+ * Read an HTTP response, using ${readfunc}(${cookie}, buf, buflen) to read
+ * up to ${buflen} bytes into ${buf} in the manner of read(2).  Parse the
+ * status line and headers, and read the body as delimited by a chunked
+ * Transfer-Encoding, a Content-Length, or EOF; or if ${nobody} is non-zero
+ * (e.g., for a response to a HEAD request), expect no body regardless of
+ * the headers.  Set ${*gotresp} to non-zero if any data was read.  Return
+ * NULL and set ${*resp} to the response on success, or return an error
+ * string.
+ */
+const char *
+httpresp_read(ssize_t (* readfunc)(void *, uint8_t *, size_t), void * cookie,
+    int nobody, struct httpresp ** resp, int * gotresp)
+{
+	struct reader R;
+	struct httpresp * H;
+	BYTES hdata;
+	BYTES body;
+	BYTES line;
+	size_t (* offs)[2];
+	const char * errstr;
+	const char * s;
+	size_t clen;
+	size_t chunklen;
+	size_t i;
+	int chunked = 0;
+	int toeof = 0;
+
+	/* Set up the reader. */
+	R.readfunc = readfunc;
+	R.cookie = cookie;
+	R.pos = R.len = 0;
+	R.gotresp = gotresp;
+	*gotresp = 0;
+
+	/* Allocate a response structure. */
+	if ((H = malloc(sizeof(struct httpresp))) == NULL) {
+		errstr = "Out of memory";
+		goto err0;
+	}
+	H->headers = NULL;
+	H->hdata = NULL;
+
+	/* Allocate buffers for header data and for the body. */
+	if ((offs = malloc(MAXHEADERS * sizeof(*offs))) == NULL) {
+		errstr = "Out of memory";
+		goto err1;
+	}
+	if ((hdata = bytes_init(0)) == NULL) {
+		errstr = "Out of memory";
+		goto err2;
+	}
+	if ((body = bytes_init(0)) == NULL) {
+		errstr = "Out of memory";
+		goto err3;
+	}
+
+	/* Read headers, skipping over any 1xx informational responses. */
+	do {
+		if ((errstr = rd_headers(&R, H, hdata, offs)) != NULL)
+			goto err4;
+	} while (H->status < 200);
+
+	/* Export the header data and construct the array of headers. */
+	if (bytes_export(hdata, (uint8_t **)&H->hdata, &i)) {
+		errstr = "Out of memory";
+		goto err4;
+	}
+	if ((H->nheaders > 0) && ((H->headers =
+	    malloc(H->nheaders * sizeof(struct httpresp_header))) == NULL)) {
+		errstr = "Out of memory";
+		goto err5;
+	}
+	for (i = 0; i < H->nheaders; i++) {
+		H->headers[i].name = &H->hdata[offs[i][0]];
+		H->headers[i].value = &H->hdata[offs[i][1]];
+	}
+
+	/*
+	 * How is the body delimited?  If there is no body, the headers
+	 * describe the body we would have gotten, so we ignore them.
+	 */
+	clen = 0;
+	if (!nobody &&
+	    ((s = httpresp_header(H, "Transfer-Encoding")) != NULL)) {
+		if (hastoken(s, "chunked"))
+			chunked = 1;
+		else if (!hastoken(s, "identity"))
+			toeof = 1;
+	}
+	if (!nobody && !chunked && !toeof) {
+		if ((s = httpresp_header(H, "Content-Length")) != NULL) {
+			if (parsenum(s, strlen(s), 10, &clen) ||
+			    (s[strspn(s, "0123456789")] != '\0')) {
+				errstr = "Bad Content-Length";
+				goto err5;
+			}
+		} else if ((H->status != 204) && (H->status != 304))
+			toeof = 1;
+	}
+
+	/* Is the server going to close the connection? */
+	if ((s = httpresp_header(H, "Connection")) != NULL) {
+		if (hastoken(s, "close"))
+			H->keepalive = 0;
+		else if (hastoken(s, "keep-alive"))
+			H->keepalive = 1;
+	}
+	if (toeof)
+		H->keepalive = 0;
+
+	/* Read the body. */
+	if (chunked) {
+		/* Allocate a buffer for chunk-size lines and trailers. */
+		if ((line = bytes_init(0)) == NULL) {
+			errstr = "Out of memory";
+			goto err5;
+		}
+
+		/* Read chunks until we get a zero-length chunk. */
+		do {
+			bytes_shrink(line, bytes_getsize(line));
+			if ((errstr = rd_line(&R, line)) != NULL)
+				goto err6;
+			s = (const char *)bytes_get(line, 0);
+			if (parsenum(s, strlen(s), 16, &chunklen)) {
+				errstr = "Bad chunk size";
+				goto err6;
+			}
+			if (chunklen == 0)
+				break;
+			if ((errstr = rd_body(&R, body, chunklen, 0)) != NULL)
+				goto err6;
+
+			/* Each chunk is followed by an empty line. */
+			bytes_shrink(line, bytes_getsize(line));
+			if ((errstr = rd_line(&R, line)) != NULL)
+				goto err6;
+			if (*bytes_get(line, 0) != '\0') {
+				errstr = "Bad chunk terminator";
+				goto err6;
+			}
+		} while (1);
+
+		/* Skip any trailers, up to the terminating empty line. */
+		do {
+			bytes_shrink(line, bytes_getsize(line));
+			if ((errstr = rd_line(&R, line)) != NULL)
+				goto err6;
+		} while (*bytes_get(line, 0) != '\0');
+		bytes_free(line);
+	} else {
+		if ((errstr = rd_body(&R, body, clen, toeof)) != NULL)
+			goto err5;
+	}
+
+	/* If there's data left over, something odd is going on. */
+	if (R.pos < R.len)
+		H->keepalive = 0;
+
+	/* NUL-terminate the body, for the convenience of our callers. */
+	if (bytes_append(body, (const uint8_t *)"", 1)) {
+		errstr = "Out of memory";
+		goto err5;
+	}
+	if (bytes_export(body, &H->body, &H->bodylen)) {
+		errstr = "Out of memory";
+		goto err5;
+	}
+	H->bodylen -= 1;
+
+	/* Free the header offsets. */
+	free(offs);
+
+	/* Success! */
+	*resp = H;
+	return (NULL);
+
+err6:
+	bytes_free(line);
+err5:
+	bytes_free(body);
+	free(H->headers);
+	free(H->hdata);
+	free(offs);
+	free(H);
+	return (errstr);
+
+err4:
+	bytes_free(body);
+err3:
+	bytes_free(hdata);
+err2:
+	free(offs);
+err1:
+	free(H);
+err0:
+	/* Failure! */
+	return (errstr);
+}
+
+/**
+ * httpresp_header(resp, name):
+ * Return the value of the first header named ${name} (compared without
+ * regard to case) in the response ${resp}, or NULL if there is none.
+ */
+const char *
+httpresp_header(const struct httpresp * resp, const char * name)
+{
+	size_t i;
+
+	for (i = 0; i < resp->nheaders; i++) {
+		if (strcasecmp(resp->headers[i].name, name) == 0)
+			return (resp->headers[i].value);
+	}
+
+	/* Not found. */
+	return (NULL);
+}
+
+/**
+ * httpresp_free(resp):
+ * Free the response ${resp}.
+ */
+void
+httpresp_free(struct httpresp * resp)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (resp == NULL)
+		return;
+
+	/* Free the body, headers, and response structure. */
+	free(resp->body);
+	free(resp->headers);
+	free(resp->hdata);
+	free(resp);
+}
@@ -0,0 +1,49 @@
+#ifndef _HTTPRESP_H_
+#define _HTTPRESP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A parsed HTTP response. */
+struct httpresp {
+	int status;			/* Status code, e.g. 200. */
+	size_t nheaders;		/* Number of headers. */
+	struct httpresp_header {
+		const char * name;
+		const char * value;
+	} * headers;			/* Headers, in the order received. */
+	uint8_t * body;			/* Body, followed by a NUL byte. */
+	size_t bodylen;			/* Body length, excluding the NUL. */
+	int keepalive;			/* Can the connection be reused? */
+	char * hdata;			/* Storage for header names and values. */
+};
+
+/**
+ * httpresp_read(readfunc, cookie, nobody, resp, gotresp):
+ * Read an HTTP response, using ${readfunc}(${cookie}, buf, buflen) to read
+ * up to ${buflen} bytes into ${buf} in the manner of read(2).  Parse the
+ * status line and headers, and read the body as delimited by a chunked
+ * Transfer-Encoding, a Content-Length, or EOF; or if ${nobody} is non-zero
+ * (e.g., for a response to a HEAD request), expect no body regardless of
+ * the headers.  Set ${*gotresp} to non-zero if any data was read.  Return
+ * NULL and set ${*resp} to the response on success, or return an error
+ * string.
+ */
+const char * httpresp_read(ssize_t (*)(void *, uint8_t *, size_t), void *,
+    int, struct httpresp **, int *);
+
+/**
+ * httpresp_header(resp, name):
+ * Return the value of the first header named ${name} (compared without
+ * regard to case) in the response ${resp}, or NULL if there is none.
+ */
+const char * httpresp_header(const struct httpresp *, const char *);
+
+/**
+ * httpresp_free(resp):
+ * Free the response ${resp}.
+ */
+void httpresp_free(struct httpresp *);
+
+#endif /* !_HTTPRESP_H_ */
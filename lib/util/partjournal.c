@@ -0,0 +1,502 @@
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "asprintf.h"
+#include "sha256.h"
+#include "sysendian.h"
+#include "warnp.h"
+
+#include "partjournal.h"
+
+/*
+ * Journal file format, with all integers stored in little-endian order:
+ *   "bsdec2j1"		Magic number.
+ *   nonce[16]		Nonce used in S3 object names.
+ *   size[8]		Disk image size.
+ *   mtime_sec[8]	Disk image modification time (seconds).
+ *   mtime_nsec[8]	Disk image modification time (nanoseconds).
+ *   partsz[8]		Part size.
+ *   nparts[8]		Number of parts.
+ *   dest[32]		SHA256(region || "\0" || bucket).
+ *   bitmap[]		(nparts + 7) / 8 bytes; bit i is set once part i is
+ *			uploaded.
+ *   etags[]		nparts x 16 bytes; the S3 ETag of each part.
+ */
+#define HDRLEN	(8 + 16 + 8 + 8 + 8 + 8 + 8 + 32)
+
+struct partjournal {
+	char * fname;
+	int fd;
+	uint64_t nparts;
+	uint64_t ndone;
+	uint8_t * bitmap;
+	size_t bitmaplen;
+	pthread_mutex_t mtx;
+};
+
+/* Fill in everything in the header ${hdr} except the nonce. */
+static void
+mkhdr(uint8_t hdr[HDRLEN], const struct stat * sb, uint64_t partsz,
+    uint64_t nparts, const char * region, const char * bucket)
+{
+	SHA256_CTX ctx;
+
+	memcpy(&hdr[0], "bsdec2j1", 8);
+	le64enc(&hdr[24], (uint64_t)sb->st_size);
+	le64enc(&hdr[32], (uint64_t)sb->st_mtim.tv_sec);
+	le64enc(&hdr[40], (uint64_t)sb->st_mtim.tv_nsec);
+	le64enc(&hdr[48], partsz);
+	le64enc(&hdr[56], nparts);
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, region, strlen(region) + 1);
+	SHA256_Update(&ctx, bucket, strlen(bucket));
+	SHA256_Final(&hdr[64], &ctx);
+}
+
+/* Write ${len} bytes from ${buf} at offset ${pos} in ${fd}. */
+static int
+pwriteall(int fd, const uint8_t * buf, size_t len, off_t pos)
+{
+	ssize_t lenwrit;
+
+	while (len > 0) {
+		if ((lenwrit = pwrite(fd, buf, len, pos)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		buf += (size_t)lenwrit;
+		len -= (size_t)lenwrit;
+		pos += lenwrit;
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/* Read ${len} bytes into ${buf} from offset ${pos} in ${fd}. */
+static int
+preadall(int fd, uint8_t * buf, size_t len, off_t pos)
+{
+	ssize_t lenread;
+
+	while (len > 0) {
+		if ((lenread = pread(fd, buf, len, pos)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		if (lenread == 0) {
+			warn0("Unexpected EOF");
+			return (-1);
+		}
+		buf += (size_t)lenread;
+		len -= (size_t)lenread;
+		pos += lenread;
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/* Create the journal file for ${J}, with the header ${hdr}. */
+static int
+create(struct partjournal * J, const uint8_t hdr[HDRLEN])
+{
+	char * tmpname;
+	off_t flen;
+
+	/* Write the journal to a temporary file, then move it into place. */
+	if (asprintf(&tmpname, "%s.tmp", J->fname) == -1)
+		goto err0;
+	if ((J->fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) {
+		warnp("open(%s)", tmpname);
+		goto err1;
+	}
+
+	/* Extend the file to full size; no parts have been uploaded yet. */
+	flen = (off_t)(HDRLEN + J->bitmaplen + J->nparts * 16);
+	if (ftruncate(J->fd, flen)) {
+		warnp("ftruncate(%s)", tmpname);
+		goto err2;
+	}
+	if (pwriteall(J->fd, hdr, HDRLEN, 0)) {
+		warnp("Error writing %s", tmpname);
+		goto err2;
+	}
+	if (fsync(J->fd)) {
+		warnp("fsync(%s)", tmpname);
+		goto err2;
+	}
+	if (rename(tmpname, J->fname)) {
+		warnp("rename(%s, %s)", tmpname, J->fname);
+		goto err2;
+	}
+	free(tmpname);
+
+	/* Success! */
+	return (0);
+
+err2:
+	close(J->fd);
+	unlink(tmpname);
+err1:
+	free(tmpname);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Read and check the existing journal file for ${J}. */
+static int
+load(struct partjournal * J, const uint8_t hdr[HDRLEN], uint8_t nonce[16])
+{
+	uint8_t fhdr[HDRLEN];
+	struct stat sb;
+	uint64_t i;
+
+	/* Is the file the right size for this image? */
+	if (fstat(J->fd, &sb)) {
+		warnp("fstat(%s)", J->fname);
+		goto err0;
+	}
+	if (sb.st_size != (off_t)(HDRLEN + J->bitmaplen + J->nparts * 16)) {
+		warn0("Journal %s does not match this upload", J->fname);
+		goto err0;
+	}
+
+	/* Read the header and bitmap. */
+	if (preadall(J->fd, fhdr, HDRLEN, 0) ||
+	    preadall(J->fd, J->bitmap, J->bitmaplen, HDRLEN)) {
+		warnp("Error reading %s", J->fname);
+		goto err0;
+	}
+
+	/* Check everything except the nonce. */
+	if (memcmp(fhdr, hdr, 8) ||
+	    memcmp(&fhdr[24], &hdr[24], HDRLEN - 24)) {
+		warn0("Journal %s does not match this upload", J->fname);
+		goto err0;
+	}
+
+	/* Use the recorded nonce, and count the completed parts. */
+	memcpy(nonce, &fhdr[8], 16);
+	for (i = 0; i < J->nparts; i++) {
+		if (J->bitmap[i / 8] & (1 << (i % 8)))
+			J->ndone++;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * partjournal_open(fname, sb, partsz, region, bucket, nonce):
+ * Open the journal ${fname} for an upload of the disk image described by
+ * ${sb} in ${partsz}-byte parts to the S3 bucket ${bucket} in region
+ * ${region}.  If the journal exists, check that it describes the same
+ * image (size and modification time), part size, and destination, and
+ * overwrite the 16-byte ${nonce} with the nonce it records; otherwise,
+ * create a new journal recording ${nonce} and no completed parts.  Return
+ * the journal, or NULL on error.
+ */
+struct partjournal *
+partjournal_open(const char * fname, const struct stat * sb, uint64_t partsz,
+    const char * region, const char * bucket, uint8_t nonce[16])
+{
+	struct partjournal * J;
+	uint8_t hdr[HDRLEN];
+	int rc;
+
+	/* Allocate a structure and figure out how big the journal is. */
+	if ((J = malloc(sizeof(struct partjournal))) == NULL)
+		goto err0;
+	if ((J->fname = strdup(fname)) == NULL)
+		goto err1;
+	J->nparts = ((uint64_t)sb->st_size + partsz - 1) / partsz;
+	J->ndone = 0;
+	J->bitmaplen = (size_t)((J->nparts + 7) / 8);
+	if ((J->bitmap = calloc(J->bitmaplen + 1, 1)) == NULL)
+		goto err2;
+
+	/* Construct the header we expect. */
+	mkhdr(hdr, sb, partsz, J->nparts, region, bucket);
+	memcpy(&hdr[8], nonce, 16);
+
+	/* Open the existing journal, or create a new one. */
+	if ((J->fd = open(fname, O_RDWR)) != -1) {
+		if (load(J, hdr, nonce))
+			goto err4;
+	} else if (errno == ENOENT) {
+		if (create(J, hdr))
+			goto err3;
+	} else {
+		warnp("open(%s)", fname);
+		goto err3;
+	}
+
+	/* Initialize the lock. */
+	if ((rc = pthread_mutex_init(&J->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err4;
+	}
+
+	/* Success! */
+	return (J);
+
+err4:
+	close(J->fd);
+err3:
+	free(J->bitmap);
+err2:
+	free(J->fname);
+err1:
+	free(J);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * partjournal_partsz(fname, partsz):
+ * If the journal ${fname} exists, set ${partsz} to the part size which it
+ * records; otherwise leave ${partsz} unchanged.  Return 0 on success or -1
+ * on error.
+ */
+int
+partjournal_partsz(const char * fname, uint64_t * partsz)
+{
+	uint8_t hdr[HDRLEN];
+	int fd;
+
+	/* If there's no journal, there's nothing to do. */
+	if ((fd = open(fname, O_RDONLY)) == -1) {
+		if (errno == ENOENT)
+			goto done;
+		warnp("open(%s)", fname);
+		goto err0;
+	}
+
+	/* Read the header and make sure it's a journal. */
+	if (preadall(fd, hdr, HDRLEN, 0)) {
+		warnp("Error reading %s", fname);
+		goto err1;
+	}
+	if (memcmp(&hdr[0], "bsdec2j1", 8)) {
+		warn0("Not an upload journal: %s", fname);
+		goto err1;
+	}
+
+	/* Extract the part size. */
+	*partsz = le64dec(&hdr[48]);
+
+	/* We don't need the journal any more. */
+	close(fd);
+
+done:
+	/* Success! */
+	return (0);
+
+err1:
+	close(fd);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * partjournal_ndone(J):
+ * Return the number of parts which the journal ${J} records as uploaded.
+ */
+uint64_t
+partjournal_ndone(struct partjournal * J)
+{
+	uint64_t ndone;
+
+	pthread_mutex_lock(&J->mtx);
+	ndone = J->ndone;
+	pthread_mutex_unlock(&J->mtx);
+
+	return (ndone);
+}
+
+/**
+ * partjournal_isdone(J, partnum):
+ * Return non-zero if the journal ${J} records part ${partnum} as uploaded.
+ */
+int
+partjournal_isdone(struct partjournal * J, uint64_t partnum)
+{
+	int isdone;
+
+	pthread_mutex_lock(&J->mtx);
+	isdone = (J->bitmap[partnum / 8] >> (partnum % 8)) & 1;
+	pthread_mutex_unlock(&J->mtx);
+
+	return (isdone);
+}
+
+/**
+ * partjournal_done(J, partnum, etag):
+ * Record in the journal ${J} that part ${partnum} has been uploaded, and
+ * that S3 returned the 16-byte ${etag} for it.  The record is written
+ * before the part is marked as complete, so a part is never marked as
+ * complete without its ETag.  This may be called by multiple threads.
+ * Return 0 on success or -1 on error.
+ */
+int
+partjournal_done(struct partjournal * J, uint64_t partnum,
+    const uint8_t etag[16])
+{
+	int rc;
+
+	/* Lock the journal; bitmap bytes are shared between parts. */
+	if ((rc = pthread_mutex_lock(&J->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Write the ETag, then set the bit and write out its byte. */
+	if (pwriteall(J->fd, etag, 16,
+	    (off_t)(HDRLEN + J->bitmaplen + partnum * 16))) {
+		warnp("Error writing %s", J->fname);
+		goto err1;
+	}
+	if (!((J->bitmap[partnum / 8] >> (partnum % 8)) & 1))
+		J->ndone++;
+	J->bitmap[partnum / 8] |= (uint8_t)(1 << (partnum % 8));
+	if (pwriteall(J->fd, &J->bitmap[partnum / 8], 1,
+	    (off_t)(HDRLEN + partnum / 8))) {
+		warnp("Error writing %s", J->fname);
+		goto err1;
+	}
+
+	/* Unlock the journal. */
+	pthread_mutex_unlock(&J->mtx);
+
+	/* Success! */
+	return (0);
+
+err1:
+	pthread_mutex_unlock(&J->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * partjournal_etag(J, partnum, etag):
+ * Read the 16-byte ETag which the journal ${J} records for part ${partnum}
+ * into ${etag}.  Return 0 on success or -1 on error.
+ */
+int
+partjournal_etag(struct partjournal * J, uint64_t partnum, uint8_t etag[16])
+{
+	int rc;
+
+	/* Lock the journal, so we don't see an ETag being written. */
+	if ((rc = pthread_mutex_lock(&J->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Read the ETag. */
+	if (preadall(J->fd, etag, 16,
+	    (off_t)(HDRLEN + J->bitmaplen + partnum * 16))) {
+		warnp("Error reading %s", J->fname);
+		goto err1;
+	}
+
+	/* Unlock the journal. */
+	pthread_mutex_unlock(&J->mtx);
+
+	/* Success! */
+	return (0);
+
+err1:
+	pthread_mutex_unlock(&J->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * partjournal_undone(J, partnum):
+ * Record in the journal ${J} that part ${partnum} needs to be uploaded
+ * again.  Return 0 on success or -1 on error.
+ */
+int
+partjournal_undone(struct partjournal * J, uint64_t partnum)
+{
+	int rc;
+
+	/* Lock the journal; bitmap bytes are shared between parts. */
+	if ((rc = pthread_mutex_lock(&J->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Clear the bit and write out its byte. */
+	if ((J->bitmap[partnum / 8] >> (partnum % 8)) & 1)
+		J->ndone--;
+	J->bitmap[partnum / 8] &= (uint8_t)~(1 << (partnum % 8));
+	if (pwriteall(J->fd, &J->bitmap[partnum / 8], 1,
+	    (off_t)(HDRLEN + partnum / 8))) {
+		warnp("Error writing %s", J->fname);
+		goto err1;
+	}
+
+	/* Unlock the journal. */
+	pthread_mutex_unlock(&J->mtx);
+
+	/* Success! */
+	return (0);
+
+err1:
+	pthread_mutex_unlock(&J->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * partjournal_close(J, remove):
+ * Close the journal ${J}, and delete it if ${remove} is non-zero.  Return
+ * 0 on success or -1 if the journal could not be deleted.
+ */
+int
+partjournal_close(struct partjournal * J, int remove)
+{
+	int rc = 0;
+
+	/* Behave consistently with free(NULL). */
+	if (J == NULL)
+		return (0);
+
+	/* Delete the journal if requested. */
+	if (remove && unlink(J->fname)) {
+		warnp("unlink(%s)", J->fname);
+		rc = -1;
+	}
+
+	/* Close the file and free everything. */
+	close(J->fd);
+	pthread_mutex_destroy(&J->mtx);
+	free(J->bitmap);
+	free(J->fname);
+	free(J);
+
+	return (rc);
+}
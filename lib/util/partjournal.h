@@ -0,0 +1,75 @@
+#ifndef _PARTJOURNAL_H_
+#define _PARTJOURNAL_H_
+
+#include <sys/stat.h>
+
+#include <stdint.h>
+
+/* Opaque type. */
+struct partjournal;
+
+/**
+ * partjournal_open(fname, sb, partsz, region, bucket, nonce):
+ * Open the journal ${fname} for an upload of the disk image described by
+ * ${sb} in ${partsz}-byte parts to the S3 bucket ${bucket} in region
+ * ${region}.  If the journal exists, check that it describes the same
+ * image (size and modification time), part size, and destination, and
+ * overwrite the 16-byte ${nonce} with the nonce it records; otherwise,
+ * create a new journal recording ${nonce} and no completed parts.  Return
+ * the journal, or NULL on error.
+ */
+struct partjournal * partjournal_open(const char *, const struct stat *,
+    uint64_t, const char *, const char *, uint8_t[16]);
+
+/**
+ * partjournal_partsz(fname, partsz):
+ * If the journal ${fname} exists, set ${partsz} to the part size which it
+ * records; otherwise leave ${partsz} unchanged.  Return 0 on success or -1
+ * on error.
+ */
+int partjournal_partsz(const char *, uint64_t *);
+
+/**
+ * partjournal_ndone(J):
+ * Return the number of parts which the journal ${J} records as uploaded.
+ */
+uint64_t partjournal_ndone(struct partjournal *);
+
+/**
+ * partjournal_isdone(J, partnum):
+ * Return non-zero if the journal ${J} records part ${partnum} as uploaded.
+ */
+int partjournal_isdone(struct partjournal *, uint64_t);
+
+/**
+ * partjournal_done(J, partnum, etag):
+ * Record in the journal ${J} that part ${partnum} has been uploaded, and
+ * that S3 returned the 16-byte ${etag} for it.  The record is written
+ * before the part is marked as complete, so a part is never marked as
+ * complete without its ETag.  This may be called by multiple threads.
+ * Return 0 on success or -1 on error.
+ */
+int partjournal_done(struct partjournal *, uint64_t, const uint8_t[16]);
+
+/**
+ * partjournal_etag(J, partnum, etag):
+ * Read the 16-byte ETag which the journal ${J} records for part ${partnum}
+ * into ${etag}.  Return 0 on success or -1 on error.
+ */
+int partjournal_etag(struct partjournal *, uint64_t, uint8_t[16]);
+
+/**
+ * partjournal_undone(J, partnum):
+ * Record in the journal ${J} that part ${partnum} needs to be uploaded
+ * again.  Return 0 on success or -1 on error.
+ */
+int partjournal_undone(struct partjournal *, uint64_t);
+
+/**
+ * partjournal_close(J, remove):
+ * Close the journal ${J}, and delete it if ${remove} is non-zero.  Return
+ * 0 on success or -1 if the journal could not be deleted.
+ */
+int partjournal_close(struct partjournal *, int);
+
+#endif /* !_PARTJOURNAL_H_ */
@@ -1,44 +1,170 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 
+#include <limits.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <openssl/ssl.h>
 
+#include "httpresp.h"
+#include "sslsess.h"
+
 #include "sslreq.h"
 
-/**
- * sslreq(host, port, certfile, req, reqlen, resp, resplen):
- * Establish an SSL connection to ${host}:${port}; verify the authenticity of
- * the server using certificates in ${certfile}; send ${reqlen} bytes from
- * ${req}; and read a response of up to ${*resplen} bytes into ${resp}.  Set
- * ${*resplen} to the length of the response read.  Return NULL on success or
- * an error string.
+/* Maximum number of idle connections to hold in the pool. */
+#define MAXIDLE		128
+
+/* Maximum time (in seconds) for which to keep an idle connection. */
+#define IDLETIME	30
+
+/* An SSL connection to ${host}:${port}. */
+struct sslconn {
+	char * host;
+	char * port;
+	int s;
+	SSL * ssl;
+	time_t lastused;
+	struct sslconn * next;
+};
+
+/* SSL context shared by all connections. */
+static SSL_CTX * ctx = NULL;
+
+/* File in which to keep SSL sessions between runs, if any. */
+static char * sessfile = NULL;
+
+/* Idle connections, most recently used first. */
+static struct sslconn * idle = NULL;
+static size_t nidle = 0;
+static pthread_mutex_t idle_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* Locks for OpenSSL to use; it only manages its own locks from 1.1.0. */
+static pthread_mutex_t * ssl_locks = NULL;
+static int ssl_nlocks;
+
+static void
+ssl_lock(int mode, int n, const char * file, int line)
+{
+
+	(void)file; /* UNUSED */
+	(void)line; /* UNUSED */
+
+	/* Acquire or release the lock. */
+	if (mode & CRYPTO_LOCK)
+		pthread_mutex_lock(&ssl_locks[n]);
+	else
+		pthread_mutex_unlock(&ssl_locks[n]);
+}
+
+static unsigned long
+ssl_threadid(void)
+{
+
+	return ((unsigned long)(uintptr_t)pthread_self());
+}
+
+/* Stop OpenSSL from using our locks, and free them. */
+static void
+ssl_locks_free(void)
+{
+	int i;
+
+	CRYPTO_set_locking_callback(NULL);
+	CRYPTO_set_id_callback(NULL);
+	for (i = 0; i < ssl_nlocks; i++)
+		pthread_mutex_destroy(&ssl_locks[i]);
+	free(ssl_locks);
+	ssl_locks = NULL;
+}
+#endif
+
+/* Remember a new session so that later connections can resume it. */
+static int
+newsess(SSL * ssl, SSL_SESSION * sess)
+{
+	struct sslconn * C = SSL_get_app_data(ssl);
+
+	/* If we can't keep the session, tell OpenSSL that we didn't. */
+	if (sslsess_put(C->host, sess))
+		return (0);
+
+	/* We took ownership of the session. */
+	return (1);
+}
+
+/* Close the connection ${C}, cleanly shutting down SSL if ${clean}. */
+static void
+conn_close(struct sslconn * C, int clean)
+{
+
+	/*
+	 * Shut down SSL.  If we're not doing so cleanly, tell OpenSSL not to
+	 * bother; otherwise it will refuse to resume the session, and the
+	 * usual reason for an unclean close is that the server dropped an
+	 * idle connection, which doesn't mean that the session is bad.
+	 */
+	if (clean)
+		SSL_shutdown(C->ssl);
+	else
+		SSL_set_shutdown(C->ssl,
+		    SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+	SSL_free(C->ssl);
+
+	/* Close the socket. */
+	close(C->s);
+
+	/* Free the connection structure. */
+	free(C->port);
+	free(C->host);
+	free(C);
+}
+
+/*
+ * Establish an SSL connection to ${host}:${port} and verify the
+ * authenticity of the server.  Return NULL on success or an error string.
  */
-const char *
-sslreq(const char * host, const char * port, const char * certfile,
-    const uint8_t * req, int reqlen, uint8_t * resp, size_t * resplen)
+static const char *
+conn_open(const char * host, const char * port, struct sslconn ** Cp)
 {
+	struct sslconn * C;
 	struct addrinfo hints;
 	struct addrinfo * res;
 	struct addrinfo * r;
-	int error;
-	int s;
-	const SSL_METHOD * meth;
-	SSL_CTX * ctx;
-	SSL * ssl;
+	SSL_SESSION * sess;
 	X509 * cert;
 	X509_NAME * name;
 	char hostname[256];
-	int readlen;
-	size_t resppos;
+	const char * errstr;
 	int on = 1;
 
+	/* Allocate a connection structure. */
+	if ((C = malloc(sizeof(struct sslconn))) == NULL) {
+		errstr = "Out of memory";
+		goto err0;
+	}
+	C->next = NULL;
+
+	/* Record the host and port so that the connection can be reused. */
+	if ((C->host = strdup(host)) == NULL) {
+		errstr = "Out of memory";
+		goto err1;
+	}
+	if ((C->port = strdup(port)) == NULL) {
+		errstr = "Out of memory";
+		goto err2;
+	}
+
 	/* Create resolver hints structure. */
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_UNSPEC;
@@ -46,45 +172,350 @@ sslreq(const char * host, const char * port, const char * certfile,
 	hints.ai_protocol = IPPROTO_TCP;
 
 	/* Perform DNS lookup. */
-	if ((error = getaddrinfo(host, port, &hints, &res)) != 0)
-		return "DNS lookup failed";
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		errstr = "DNS lookup failed";
+		goto err3;
+	}
 
 	/* Iterate through the addresses we obtained trying to connect. */
 	for (r = res; r != NULL; r = r->ai_next) {
 		/* Create a socket. */
-		if ((s = socket(r->ai_family, r->ai_socktype, 0)) == -1)
+		if ((C->s = socket(r->ai_family, r->ai_socktype, 0)) == -1)
 			continue;
 
 		/* Attempt to connect. */
-		if (connect(s, r->ai_addr, r->ai_addrlen) == 0)
+		if (connect(C->s, r->ai_addr, r->ai_addrlen) == 0)
 			break;
 
 		/* Close the socket; this address didn't work. */
-		close(s);
+		close(C->s);
 	}
 
 	/* Free the addresses. */
 	freeaddrinfo(res);
 
 	/* Did we manage to connect? */
-	if (r == NULL)
-		return "Could not connect";
+	if (r == NULL) {
+		errstr = "Could not connect";
+		goto err3;
+	}
 
 	/* Disable SIGPIPE on this socket. */
-	if (setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)))
-		return "Could not disable SIGPIPE";
+	if (setsockopt(C->s, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on))) {
+		errstr = "Could not disable SIGPIPE";
+		goto err4;
+	}
+
+	/* Create an SSL connection within the shared context. */
+	if ((C->ssl = SSL_new(ctx)) == NULL) {
+		errstr = "Could not create SSL connection";
+		goto err4;
+	}
+	if (!SSL_set_fd(C->ssl, C->s)) {
+		errstr = "Could not attach SSL to socket";
+		goto err5;
+	}
+
+	/* Tell the server which host we want, and remember it ourselves. */
+	if (!SSL_set_tlsext_host_name(C->ssl, host)) {
+		errstr = "Could not set SSL server name";
+		goto err5;
+	}
+	SSL_set_app_data(C->ssl, C);
+
+	/* Resume our last session with this host, if we have one. */
+	if ((sess = sslsess_get(host)) != NULL) {
+		SSL_set_session(C->ssl, sess);
+		SSL_SESSION_free(sess);
+	}
+
+	/* Perform the SSL handshake. */
+	if (SSL_connect(C->ssl) != 1) {
+		errstr = "SSL handshake failed";
+		goto err5;
+	}
+
+	/* Make sure the server's certificate is valid. */
+	if (SSL_get_verify_result(C->ssl) != X509_V_OK) {
+		errstr = "Could not verify server SSL certificate";
+		goto err5;
+	}
+
+	/* Get the server's certificate. */
+	if ((cert = SSL_get_peer_certificate(C->ssl)) == NULL) {
+		errstr = "Could not get server SSL certificate";
+		goto err5;
+	}
+
+	/* Extract the name. */
+	if ((name = X509_get_subject_name(cert)) == NULL) {
+		errstr = "Could not extract subject name from certificate";
+		goto err6;
+	}
+	if (!X509_NAME_get_text_by_NID(name, NID_commonName, hostname, 256)) {
+		errstr = "Could not extract CN from certificate";
+		goto err6;
+	}
+
+	/* Does the name match? */
+	if (strcasecmp(hostname, host) &&
+	    ((hostname[0] != '*') || (hostname[1] != '.') ||
+	    strcasecmp(&hostname[2], host))) {
+		errstr = "Name on SSL certificate does not match server";
+		goto err6;
+	}
+
+	/* We don't need the certificate any more. */
+	X509_free(cert);
+
+	/* Success! */
+	*Cp = C;
+	return (NULL);
+
+err6:
+	X509_free(cert);
+err5:
+	SSL_free(C->ssl);
+err4:
+	close(C->s);
+err3:
+	free(C->port);
+err2:
+	free(C->host);
+err1:
+	free(C);
+err0:
+	/* Failure! */
+	return (errstr);
+}
+
+/*
+ * Is the idle connection ${C} still usable?  The server shouldn't send us
+ * anything while we're not waiting for a response, so if the socket is
+ * readable then the server has closed the connection (or is confused).
+ */
+static int
+conn_alive(struct sslconn * C)
+{
+	struct pollfd pfd;
+
+	/* Check whether the socket is readable without blocking. */
+	pfd.fd = C->s;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) != 0)
+		return (0);
+
+	/* Nothing there; the connection looks fine. */
+	return (1);
+}
+
+/*
+ * Remove and return an idle connection to ${host}:${port} from the pool,
+ * or return NULL if there are none.  Connections which have been idle for
+ * too long or which have been closed by the server are discarded.
+ */
+static struct sslconn *
+pool_get(const char * host, const char * port)
+{
+	struct sslconn ** Cp;
+	struct sslconn * C;
+	struct sslconn * stale = NULL;
+	struct sslconn * found = NULL;
+	time_t now = time(NULL);
+
+	/* Scan the list of idle connections. */
+	pthread_mutex_lock(&idle_mtx);
+	for (Cp = &idle; (C = *Cp) != NULL; ) {
+		if (now - C->lastused > IDLETIME) {
+			/* Move to the list of stale connections. */
+			*Cp = C->next;
+			C->next = stale;
+			stale = C;
+			nidle--;
+		} else if ((found == NULL) && (strcmp(C->host, host) == 0) &&
+		    (strcmp(C->port, port) == 0)) {
+			/* Take this connection. */
+			*Cp = C->next;
+			C->next = NULL;
+			found = C;
+			nidle--;
+		} else
+			Cp = &C->next;
+	}
+	pthread_mutex_unlock(&idle_mtx);
+
+	/* Close stale connections, outside of the lock. */
+	while ((C = stale) != NULL) {
+		stale = C->next;
+		conn_close(C, 1);
+	}
+
+	/* Discard the connection we found if the server has closed it. */
+	if ((found != NULL) && !conn_alive(found)) {
+		conn_close(found, 0);
+		found = NULL;
+	}
+
+	/* Return the connection we found, if any. */
+	return (found);
+}
+
+/* Return the connection ${C} to the pool, or close it if the pool is full. */
+static void
+pool_put(struct sslconn * C)
+{
+
+	/* Record when this connection became idle. */
+	C->lastused = time(NULL);
+
+	/* Add to the front of the list if there's space. */
+	pthread_mutex_lock(&idle_mtx);
+	if (nidle < MAXIDLE) {
+		C->next = idle;
+		idle = C;
+		nidle++;
+		C = NULL;
+	}
+	pthread_mutex_unlock(&idle_mtx);
+
+	/* If we didn't keep the connection, close it. */
+	if (C != NULL)
+		conn_close(C, 1);
+}
+
+/* Read up to ${buflen} bytes from the connection ${cookie} into ${buf}. */
+static ssize_t
+conn_read(void * cookie, uint8_t * buf, size_t buflen)
+{
+	struct sslconn * C = cookie;
+	int readlen;
+
+	/* Read data; SSL_read takes an int length. */
+	if ((readlen = SSL_read(C->ssl, buf,
+	    (buflen > INT_MAX) ? INT_MAX : (int)buflen)) < 0)
+		return (-1);
+
+	/* Return the number of bytes read, or 0 on EOF. */
+	return ((ssize_t)readlen);
+}
+
+/* Write the ${cnt} buffers described by ${iov} to the connection ${C}. */
+static int
+conn_write(struct sslconn * C, const struct iovec * iov, size_t cnt)
+{
+	const uint8_t * buf;
+	size_t len;
+	int writelen;
+	size_t i;
+
+	/* Write straight out of the caller's buffers. */
+	for (i = 0; i < cnt; i++) {
+		buf = iov[i].iov_base;
+		for (len = iov[i].iov_len; len > 0; len -= (size_t)writelen) {
+			writelen = (len > INT_MAX) ? INT_MAX : (int)len;
+			if ((writelen = SSL_write(C->ssl, buf, writelen)) <= 0)
+				return (-1);
+			buf += writelen;
+		}
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/*
+ * Send the ${reqcnt} buffers described by ${req} over the connection ${C},
+ * followed by the body produced by ${bodyfunc} if it is not NULL, and read
+ * the response into ${*resp}.  Set ${*gotresp} to non-zero if any part of a
+ * response was received.  Return NULL on success or an error string.
+ */
+static const char *
+conn_req(struct sslconn * C, const struct iovec * req, size_t reqcnt,
+    sslreq_bodyfunc * bodyfunc, void * cookie,
+    struct httpresp ** resp, int * gotresp)
+{
+	const struct iovec * iov;
+	size_t iovcnt;
+	int start;
+	int nobody;
+
+	/* Nothing received yet. */
+	*gotresp = 0;
+
+	/* Write our HTTP request. */
+	if (conn_write(C, req, reqcnt))
+		return ("Could not write request");
+
+	/* Write the body as it is produced, starting from the beginning. */
+	for (start = 1; bodyfunc != NULL; start = 0) {
+		if ((bodyfunc)(cookie, start, &iov, &iovcnt))
+			return ("Could not produce request body");
+		if (iovcnt == 0)
+			break;
+		if (conn_write(C, iov, iovcnt))
+			return ("Could not write request");
+	}
+
+	/* Read and parse the response; responses to HEAD have no body. */
+	nobody = (req[0].iov_len >= 5) &&
+	    (memcmp(req[0].iov_base, "HEAD ", 5) == 0);
+	return (httpresp_read(conn_read, C, nobody, resp, gotresp));
+}
+
+/**
+ * sslreq_init(certfile, sessfile):
+ * Initialize the SSL library and create the SSL context which will be used
+ * for all connections, verifying the authenticity of servers using
+ * certificates in ${certfile}.  If ${sessfile} is not NULL, load SSL
+ * sessions from it so that connections can be resumed, and save them back
+ * to it in sslreq_done().  Return NULL on success or an error string.
+ */
+const char *
+sslreq_init(const char * certfile, const char * _sessfile)
+{
+	const SSL_METHOD * meth;
+	const char * errstr;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	int i;
+#endif
 
 	/* Launch SSL. */
-	if (!SSL_library_init())
-		return "Could not initialize SSL";
+	if (!SSL_library_init()) {
+		errstr = "Could not initialize SSL";
+		goto err0;
+	}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	/* Give OpenSSL the locks it needs to be used from multiple threads. */
+	ssl_nlocks = CRYPTO_num_locks();
+	if ((ssl_locks = malloc(ssl_nlocks * sizeof(pthread_mutex_t))) == NULL) {
+		errstr = "Out of memory";
+		goto err0;
+	}
+	for (i = 0; i < ssl_nlocks; i++) {
+		if (pthread_mutex_init(&ssl_locks[i], NULL)) {
+			while (i > 0)
+				pthread_mutex_destroy(&ssl_locks[--i]);
+			free(ssl_locks);
+			errstr = "Could not initialize SSL locks";
+			goto err0;
+		}
+	}
+	CRYPTO_set_id_callback(ssl_threadid);
+	CRYPTO_set_locking_callback(ssl_lock);
+#endif
 
 	/* Opt for compatibility. */
-	if ((meth = SSLv23_client_method()) == NULL)
-		return "Could not obtain SSL method";
+	if ((meth = SSLv23_client_method()) == NULL) {
+		errstr = "Could not obtain SSL method";
+		goto err1;
+	}
 
 	/* Create an SSL context. */
-	if ((ctx = SSL_CTX_new((void *)(uintptr_t)(const void *)meth)) == NULL)
-		return "Could not create SSL context";
+	if ((ctx = SSL_CTX_new((void *)(uintptr_t)(const void *)meth)) == NULL) {
+		errstr = "Could not create SSL context";
+		goto err1;
+	}
 
 	/* Disable SSLv2 and SSLv3. */
 	SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
@@ -92,60 +523,182 @@ sslreq(const char * host, const char * port, const char * certfile,
 	/* We want blocking I/O; tell OpenSSL to keep trying reads/writes. */
 	SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
 
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	/* Responses may be delimited by servers closing without close_notify. */
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
 	/* Load root certificates. */
-	if (!SSL_CTX_load_verify_locations(ctx, certfile, NULL))
-		return "Could not load root certificates";
+	if (!SSL_CTX_load_verify_locations(ctx, certfile, NULL)) {
+		errstr = "Could not load root certificates";
+		goto err2;
+	}
 
-	/* Create an SSL connection within the specified context. */
-	if ((ssl = SSL_new(ctx)) == NULL)
-		return "Could not create SSL connection";
-	if (!SSL_set_fd(ssl, s))
-		return "Could not attach SSL to socket";
+	/* Hand new sessions to us instead of keeping them internally. */
+	SSL_CTX_set_session_cache_mode(ctx,
+	    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, newsess);
 
-	/* Perform the SSL handshake. */
-	if (SSL_connect(ssl) != 1)
-		return "SSL handshake failed";
+	/* Load sessions saved by a previous run. */
+	if (_sessfile != NULL) {
+		if ((sessfile = strdup(_sessfile)) == NULL) {
+			errstr = "Out of memory";
+			goto err2;
+		}
+		if (sslsess_load(sessfile)) {
+			errstr = "Could not load SSL sessions";
+			goto err3;
+		}
+	}
 
-	/* Make sure the server's certificate is valid. */
-	if (SSL_get_verify_result(ssl) != X509_V_OK)
-		return "Could not verify server SSL certificate";
+	/* Success! */
+	return (NULL);
 
-	/* Get the server's certificate. */
-	if ((cert = SSL_get_peer_certificate(ssl)) == NULL)
-		return "Could not get server SSL certificate";
+err3:
+	sslsess_free();
+	free(sessfile);
+	sessfile = NULL;
+err2:
+	SSL_CTX_free(ctx);
+	ctx = NULL;
+err1:
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	ssl_locks_free();
+#endif
+err0:
+	/* Failure! */
+	return (errstr);
+}
 
-	/* Extract the name. */
-	if ((name = X509_get_subject_name(cert)) == NULL)
-		return "Could not extract subject name from certificate";
-	if (!X509_NAME_get_text_by_NID(name, NID_commonName, hostname, 256))
-		return "Could not extract CN from certificate";
+/**
+ * sslreq(host, port, req, reqcnt, resp):
+ * Send the ${reqcnt} buffers described by the iovec array ${req} to
+ * ${host}:${port} over an SSL connection without concatenating them, and
+ * read and parse the HTTP response into ${*resp}, which the caller must
+ * free with httpresp_free().  An idle connection to the same host is reused
+ * if one is available; otherwise a new connection is established and the
+ * authenticity of the server is verified.  Unless the server asks to close
+ * the connection or delimits the response by closing it, the connection is
+ * kept for use by later requests.  If the request is a HEAD request, the
+ * response is expected to have no body.  Return NULL on success or an error
+ * string.  The function sslreq_init() must have been called.
+ */
+const char *
+sslreq(const char * host, const char * port,
+    const struct iovec * req, size_t reqcnt, struct httpresp ** resp)
+{
 
-	/* Does the name match? */
-	if (strcasecmp(hostname, host) &&
-	    ((hostname[0] != '*') || (hostname[1] != '.') ||
-	    strcasecmp(&hostname[2], host)))
-		return "Name on SSL certificate does not match server";
+	return (sslreq_stream(host, port, req, reqcnt, NULL, NULL, resp));
+}
 
-	/* Write our HTTP request. */
-	if (SSL_write(ssl, req, reqlen) < reqlen)
-		return "Could not write request";
+/**
+ * sslreq_stream(host, port, req, reqcnt, bodyfunc, cookie, resp):
+ * As sslreq(), except that after the ${reqcnt} buffers described by ${req}
+ * are sent, the request body is produced piece by piece while it is being
+ * sent, by calling ${bodyfunc}(${cookie}, start, &iov, &iovcnt) until it
+ * sets iovcnt to zero; see sslreq_bodyfunc.  The body is started again from
+ * the beginning if the request needs to be resent.
+ */
+const char *
+sslreq_stream(const char * host, const char * port,
+    const struct iovec * req, size_t reqcnt, sslreq_bodyfunc * bodyfunc,
+    void * cookie, struct httpresp ** resp)
+{
+	struct sslconn * C;
+	const char * errstr;
+	int gotresp;
 
-	/* Read the response. */
-	for (resppos = 0; ; resppos += readlen) {
-		if ((readlen = SSL_read(ssl, &resp[resppos], *resplen)) <= 0)
-			break;
-		*resplen -= readlen;
+	/* Try an idle connection first, if we have one. */
+	if ((C = pool_get(host, port)) != NULL) {
+		if ((errstr = conn_req(C, req, reqcnt, bodyfunc, cookie,
+		    resp, &gotresp)) == NULL)
+			goto done;
+		conn_close(C, 0);
+
+		/*
+		 * If the server started to respond, this wasn't a connection
+		 * which went stale while it was idle; don't resend.
+		 */
+		if (gotresp)
+			return (errstr);
 	}
-	*resplen = resppos;
 
-	/* Did the read fail? */
-	if (readlen == -1)
-		return "Could not read response";
+	/* Establish a new connection. */
+	if ((errstr = conn_open(host, port, &C)) != NULL)
+		return (errstr);
 
-	/* Shut down SSL. */
-	SSL_shutdown(ssl);
-	SSL_free(ssl);
-	SSL_CTX_free(ctx);
+	/* Send the request and read the response. */
+	if ((errstr = conn_req(C, req, reqcnt, bodyfunc, cookie,
+	    resp, &gotresp)) != NULL) {
+		conn_close(C, 0);
+		return (errstr);
+	}
+
+done:
+	/* Keep the connection if possible. */
+	if ((*resp)->keepalive)
+		pool_put(C);
+	else
+		conn_close(C, 1);
 
+	/* Success! */
 	return (NULL);
 }
+
+/**
+ * sslreq_flush(void):
+ * Close all of the idle connections held for reuse by sslreq().
+ */
+void
+sslreq_flush(void)
+{
+	struct sslconn * C;
+	struct sslconn * list;
+
+	/* Take the entire list of idle connections. */
+	pthread_mutex_lock(&idle_mtx);
+	list = idle;
+	idle = NULL;
+	nidle = 0;
+	pthread_mutex_unlock(&idle_mtx);
+
+	/* Close them all. */
+	while ((C = list) != NULL) {
+		list = C->next;
+		conn_close(C, 1);
+	}
+}
+
+/**
+ * sslreq_done(void):
+ * Close all idle connections, save SSL sessions if sslreq_init() was given
+ * a file to keep them in, and free the shared SSL context.  Return NULL on
+ * success or an error string.
+ */
+const char *
+sslreq_done(void)
+{
+	const char * errstr = NULL;
+
+	/* Close idle connections. */
+	sslreq_flush();
+
+	/* Save our sessions for next time. */
+	if ((sessfile != NULL) && sslsess_save(sessfile))
+		errstr = "Could not save SSL sessions";
+	free(sessfile);
+	sessfile = NULL;
+	sslsess_free();
+
+	/* Free the SSL context. */
+	SSL_CTX_free(ctx);
+	ctx = NULL;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	/* Release the locks we gave to OpenSSL. */
+	ssl_locks_free();
+#endif
+
+	/* Return status. */
+	return (errstr);
+}
@@ -1,15 +1,73 @@
 #ifndef _SSLREQ_H_
 #define _SSLREQ_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* Opaque types. */
+struct httpresp;
+struct iovec;
+
+/**
+ * sslreq_init(certfile, sessfile):
+ * Initialize the SSL library and create the SSL context which will be used
+ * for all connections, verifying the authenticity of servers using
+ * certificates in ${certfile}.  If ${sessfile} is not NULL, load SSL
+ * sessions from it so that connections can be resumed, and save them back
+ * to it in sslreq_done().  Return NULL on success or an error string.
+ */
+const char * sslreq_init(const char *, const char *);
+
+/**
+ * sslreq(host, port, req, reqcnt, resp):
+ * Send the ${reqcnt} buffers described by the iovec array ${req} to
+ * ${host}:${port} over an SSL connection without concatenating them, and
+ * read and parse the HTTP response into ${*resp}, which the caller must
+ * free with httpresp_free().  An idle connection to the same host is reused
+ * if one is available; otherwise a new connection is established and the
+ * authenticity of the server is verified.  Unless the server asks to close
+ * the connection or delimits the response by closing it, the connection is
+ * kept for use by later requests.  If the request is a HEAD request, the
+ * response is expected to have no body.  Return NULL on success or an error
+ * string.  The function sslreq_init() must have been called.
+ */
+const char * sslreq(const char *, const char *,
+    const struct iovec *, size_t, struct httpresp **);
+
+/**
+ * sslreq_bodyfunc(cookie, start, iov, iovcnt):
+ * Produce the next piece of a request body, and point ${*iov} at an array
+ * of ${*iovcnt} buffers holding it; these must remain valid until the next
+ * call.  If ${start} is non-zero, produce the first piece of the body
+ * (again, if it has been produced before).  Set ${*iovcnt} to zero once the
+ * body is complete.  Return 0 on success or -1 on error.
+ */
+typedef int sslreq_bodyfunc(void *, int, const struct iovec **, size_t *);
+
+/**
+ * sslreq_stream(host, port, req, reqcnt, bodyfunc, cookie, resp):
+ * As sslreq(), except that after the ${reqcnt} buffers described by ${req}
+ * are sent, the request body is produced piece by piece while it is being
+ * sent, by calling ${bodyfunc}(${cookie}, start, &iov, &iovcnt) until it
+ * sets iovcnt to zero; see sslreq_bodyfunc.  The body is started again from
+ * the beginning if the request needs to be resent.
+ */
+const char * sslreq_stream(const char *, const char *,
+    const struct iovec *, size_t, sslreq_bodyfunc *, void *,
+    struct httpresp **);
+
+/**
+ * sslreq_flush(void):
+ * Close all of the idle connections held for reuse by sslreq().
+ */
+void sslreq_flush(void);
+
 /**
- * sslreq(host, port, certfile, req, reqlen, resp, resplen):
- * Establish an SSL connection to ${host}:${port}; verify the authenticity of
- * the server using certificates in ${certfile}; send ${reqlen} bytes from
- * ${req}; and read a response of up to ${*resplen} bytes into ${resp}.  Set
- * ${*resplen} to the length of the response read.  Return NULL on success or
- * an error string.
+ * sslreq_done(void):
+ * Close all idle connections, save SSL sessions if sslreq_init() was given
+ * a file to keep them in, and free the shared SSL context.  Return NULL on
+ * success or an error string.
  */
-const char * sslreq(const char *, const char *, const char *,
-    const uint8_t *, int, uint8_t *, size_t *);
+const char * sslreq_done(void);
 
 #endif /* !_SSLREQ_H_ */
@@ -0,0 +1,326 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+
+#include "asprintf.h"
+#include "hexify.h"
+#include "warnp.h"
+
+#include "sslsess.h"
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define SSL_SESSION_up_ref(s) \
+    CRYPTO_add(&(s)->references, 1, CRYPTO_LOCK_SSL_SESSION)
+#endif
+
+/* Maximum length of an encoded session which we will load. */
+#define MAXSESSLEN	16384
+
+/* The session to resume for a host. */
+struct sslsess {
+	char * host;
+	SSL_SESSION * sess;
+	struct sslsess * next;
+};
+
+/* Sessions we know about. */
+static struct sslsess * sessions = NULL;
+static pthread_mutex_t sess_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Is the session ${sess} still usable? */
+static int
+sess_ok(SSL_SESSION * sess)
+{
+
+	/* Has the session expired? */
+	if ((long)time(NULL) - SSL_SESSION_get_time(sess) >=
+	    SSL_SESSION_get_timeout(sess))
+		return (0);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	/* Can the session actually be resumed? */
+	if (!SSL_SESSION_is_resumable(sess))
+		return (0);
+#endif
+
+	/* Looks good. */
+	return (1);
+}
+
+/**
+ * sslsess_get(host):
+ * Return a session which can be used to resume a connection to ${host},
+ * or NULL if there is none.  The caller must SSL_SESSION_free() the
+ * session which is returned.
+ */
+SSL_SESSION *
+sslsess_get(const char * host)
+{
+	struct sslsess * S;
+	SSL_SESSION * sess = NULL;
+
+	/* Look for a session for this host. */
+	pthread_mutex_lock(&sess_mtx);
+	for (S = sessions; S != NULL; S = S->next) {
+		if (strcmp(S->host, host))
+			continue;
+		if (sess_ok(S->sess)) {
+			sess = S->sess;
+			SSL_SESSION_up_ref(sess);
+		}
+		break;
+	}
+	pthread_mutex_unlock(&sess_mtx);
+
+	/* Return the session, if any. */
+	return (sess);
+}
+
+/**
+ * sslsess_put(host, sess):
+ * Record ${sess} as the session to use for resuming connections to
+ * ${host}, replacing any previous session for ${host}.  On success, this
+ * takes ownership of the caller's reference to ${sess}.  Return 0 on
+ * success or -1 on error.
+ */
+int
+sslsess_put(const char * host, SSL_SESSION * sess)
+{
+	struct sslsess * S;
+	SSL_SESSION * oldsess = NULL;
+
+	/* Look for an existing record for this host. */
+	pthread_mutex_lock(&sess_mtx);
+	for (S = sessions; S != NULL; S = S->next) {
+		if (strcmp(S->host, host) == 0)
+			break;
+	}
+
+	/* Add a new record if necessary. */
+	if (S == NULL) {
+		if ((S = malloc(sizeof(struct sslsess))) == NULL)
+			goto err1;
+		if ((S->host = strdup(host)) == NULL)
+			goto err2;
+		S->sess = NULL;
+		S->next = sessions;
+		sessions = S;
+	}
+
+	/* Replace the session. */
+	oldsess = S->sess;
+	S->sess = sess;
+	pthread_mutex_unlock(&sess_mtx);
+
+	/* Free the session we replaced, outside of the lock. */
+	if (oldsess != NULL)
+		SSL_SESSION_free(oldsess);
+
+	/* Success! */
+	return (0);
+
+err2:
+	free(S);
+err1:
+	pthread_mutex_unlock(&sess_mtx);
+
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * sslsess_load(fname):
+ * Load sessions saved by sslsess_save() from ${fname}.  A missing file is
+ * not an error, and sessions which have expired are ignored.  Return 0 on
+ * success or -1 on error.
+ */
+int
+sslsess_load(const char * fname)
+{
+	FILE * f;
+	char * line = NULL;
+	size_t linecap = 0;
+	char * hex;
+	uint8_t * der;
+	const unsigned char * p;
+	size_t derlen;
+	SSL_SESSION * sess;
+
+	/* Open the file, if it exists. */
+	if ((f = fopen(fname, "r")) == NULL) {
+		if (errno == ENOENT) {
+			errno = 0;
+			return (0);
+		}
+		warnp("fopen(%s)", fname);
+		goto err0;
+	}
+
+	/* Allocate space for decoding sessions. */
+	if ((der = malloc(MAXSESSLEN)) == NULL)
+		goto err1;
+
+	/* Each line is "<host> <hexified DER-encoded session>". */
+	while (getline(&line, &linecap, f) != -1) {
+		/* Strip the EOL and split the line. */
+		line[strcspn(line, "\r\n")] = '\0';
+		if ((hex = strchr(line, ' ')) == NULL)
+			continue;
+		*hex++ = '\0';
+
+		/* Decode the session; skip lines which don't make sense. */
+		derlen = strlen(hex) / 2;
+		if ((strlen(hex) % 2) || (derlen > MAXSESSLEN) ||
+		    unhexify(hex, der, derlen))
+			continue;
+		p = der;
+		if ((sess = d2i_SSL_SESSION(NULL, &p, (long)derlen)) == NULL)
+			continue;
+
+		/* Keep the session if it's still usable. */
+		if (!sess_ok(sess) || sslsess_put(line, sess))
+			SSL_SESSION_free(sess);
+	}
+
+	/* Check for error. */
+	if (ferror(f)) {
+		warnp("Error reading %s", fname);
+		goto err2;
+	}
+
+	/* Clean up. */
+	free(der);
+	free(line);
+	fclose(f);
+
+	/* Success! */
+	return (0);
+
+err2:
+	free(der);
+err1:
+	free(line);
+	fclose(f);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * sslsess_save(fname):
+ * Save all of the sessions which are still usable to ${fname}.  The file
+ * is replaced atomically and is readable only by its owner, since the
+ * sessions contain secret keys.  Return 0 on success or -1 on error.
+ */
+int
+sslsess_save(const char * fname)
+{
+	struct sslsess * S;
+	char * tmpname;
+	int fd;
+	FILE * f;
+	uint8_t * der;
+	unsigned char * p;
+	char * hex;
+	int derlen;
+
+	/* Write to a temporary file first. */
+	if (asprintf(&tmpname, "%s.tmp", fname) == -1)
+		goto err0;
+	if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		warnp("open(%s)", tmpname);
+		goto err1;
+	}
+	if ((f = fdopen(fd, "w")) == NULL) {
+		warnp("fdopen");
+		close(fd);
+		goto err2;
+	}
+
+	/* Write out each session. */
+	pthread_mutex_lock(&sess_mtx);
+	for (S = sessions; S != NULL; S = S->next) {
+		/* Don't bother saving sessions which we can't use. */
+		if (!sess_ok(S->sess))
+			continue;
+
+		/* Encode the session. */
+		if (((derlen = i2d_SSL_SESSION(S->sess, NULL)) <= 0) ||
+		    (derlen > MAXSESSLEN))
+			continue;
+		if ((der = malloc(derlen)) == NULL)
+			goto err3;
+		if ((hex = malloc(derlen * 2 + 1)) == NULL) {
+			free(der);
+			goto err3;
+		}
+		p = der;
+		i2d_SSL_SESSION(S->sess, &p);
+		hexify(der, hex, derlen);
+
+		/* Write "<host> <hex>". */
+		if (fprintf(f, "%s %s\n", S->host, hex) < 0) {
+			warnp("Error writing %s", tmpname);
+			free(hex);
+			free(der);
+			goto err3;
+		}
+		free(hex);
+		free(der);
+	}
+	pthread_mutex_unlock(&sess_mtx);
+
+	/* Close the file and move it into place. */
+	if (fclose(f)) {
+		warnp("fclose(%s)", tmpname);
+		goto err2;
+	}
+	if (rename(tmpname, fname)) {
+		warnp("rename(%s, %s)", tmpname, fname);
+		goto err2;
+	}
+
+	/* Free the temporary file name. */
+	free(tmpname);
+
+	/* Success! */
+	return (0);
+
+err3:
+	pthread_mutex_unlock(&sess_mtx);
+	fclose(f);
+err2:
+	unlink(tmpname);
+err1:
+	free(tmpname);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * sslsess_free(void):
+ * Forget all of the sessions we know about.
+ */
+void
+sslsess_free(void)
+{
+	struct sslsess * S;
+
+	pthread_mutex_lock(&sess_mtx);
+	while ((S = sessions) != NULL) {
+		sessions = S->next;
+		SSL_SESSION_free(S->sess);
+		free(S->host);
+		free(S);
+	}
+	pthread_mutex_unlock(&sess_mtx);
+}
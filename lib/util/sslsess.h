@@ -0,0 +1,45 @@
+#ifndef _SSLSESS_H_
+#define _SSLSESS_H_
+
+#include <openssl/ssl.h>
+
+/**
+ * sslsess_get(host):
+ * Return a session which can be used to resume a connection to ${host},
+ * or NULL if there is none.  The caller must SSL_SESSION_free() the
+ * session which is returned.
+ */
+SSL_SESSION * sslsess_get(const char *);
+
+/**
+ * sslsess_put(host, sess):
+ * Record ${sess} as the session to use for resuming connections to
+ * ${host}, replacing any previous session for ${host}.  On success, this
+ * takes ownership of the caller's reference to ${sess}.  Return 0 on
+ * success or -1 on error.
+ */
+int sslsess_put(const char *, SSL_SESSION *);
+
+/**
+ * sslsess_load(fname):
+ * Load sessions saved by sslsess_save() from ${fname}.  A missing file is
+ * not an error, and sessions which have expired are ignored.  Return 0 on
+ * success or -1 on error.
+ */
+int sslsess_load(const char *);
+
+/**
+ * sslsess_save(fname):
+ * Save all of the sessions which are still usable to ${fname}.  The file
+ * is replaced atomically and is readable only by its owner, since the
+ * sessions contain secret keys.  Return 0 on success or -1 on error.
+ */
+int sslsess_save(const char *);
+
+/**
+ * sslsess_free(void):
+ * Forget all of the sessions we know about.
+ */
+void sslsess_free(void);
+
+#endif /* !_SSLSESS_H_ */
@@ -0,0 +1,291 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "asprintf.h"
+#include "warnp.h"
+
+#include "statefile.h"
+
+/* A recorded value. */
+struct statefile_kv {
+	char * key;
+	char * value;
+	struct statefile_kv * next;
+};
+
+struct statefile {
+	char * fname;
+	struct statefile_kv * head;
+	struct statefile_kv ** tail;
+};
+
+/* Add or replace the value for ${key} in memory. */
+static int
+put(struct statefile * S, const char * key, const char * value)
+{
+	struct statefile_kv * KV;
+	char * newvalue;
+
+	/* Duplicate the value. */
+	if ((newvalue = strdup(value)) == NULL)
+		goto err0;
+
+	/* Replace an existing value if there is one. */
+	for (KV = S->head; KV != NULL; KV = KV->next) {
+		if (strcmp(KV->key, key) == 0) {
+			free(KV->value);
+			KV->value = newvalue;
+			return (0);
+		}
+	}
+
+	/* Otherwise, add a record at the end so the file stays in order. */
+	if ((KV = malloc(sizeof(struct statefile_kv))) == NULL)
+		goto err1;
+	if ((KV->key = strdup(key)) == NULL)
+		goto err2;
+	KV->value = newvalue;
+	KV->next = NULL;
+	*S->tail = KV;
+	S->tail = &KV->next;
+
+	/* Success! */
+	return (0);
+
+err2:
+	free(KV);
+err1:
+	free(newvalue);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Load the values recorded in ${S->fname}. */
+static int
+load(struct statefile * S)
+{
+	FILE * f;
+	char * line = NULL;
+	size_t linecap = 0;
+	char * value;
+
+	/* Open the file, if it exists. */
+	if ((f = fopen(S->fname, "r")) == NULL) {
+		if (errno == ENOENT) {
+			errno = 0;
+			return (0);
+		}
+		warnp("fopen(%s)", S->fname);
+		goto err0;
+	}
+
+	/* Each line is "<key> <value>". */
+	while (getline(&line, &linecap, f) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if ((value = strchr(line, ' ')) == NULL) {
+			warn0("Malformed line in %s: %s", S->fname, line);
+			goto err1;
+		}
+		*value++ = '\0';
+		if (put(S, line, value))
+			goto err1;
+	}
+
+	/* Check for error. */
+	if (ferror(f)) {
+		warnp("Error reading %s", S->fname);
+		goto err1;
+	}
+
+	/* Clean up. */
+	free(line);
+	fclose(f);
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(line);
+	fclose(f);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Write out all of the values in ${S}, replacing the file atomically. */
+static int
+save(struct statefile * S)
+{
+	struct statefile_kv * KV;
+	char * tmpname;
+	int fd;
+	FILE * f;
+
+	/* Write to a temporary file first. */
+	if (asprintf(&tmpname, "%s.tmp", S->fname) == -1)
+		goto err0;
+	if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		warnp("open(%s)", tmpname);
+		goto err1;
+	}
+	if ((f = fdopen(fd, "w")) == NULL) {
+		warnp("fdopen");
+		close(fd);
+		goto err2;
+	}
+
+	/* Write out each value. */
+	for (KV = S->head; KV != NULL; KV = KV->next) {
+		if (fprintf(f, "%s %s\n", KV->key, KV->value) < 0) {
+			warnp("Error writing %s", tmpname);
+			goto err3;
+		}
+	}
+
+	/* Make sure it's on disk before we move it into place. */
+	if (fflush(f) || fsync(fileno(f))) {
+		warnp("Error writing %s", tmpname);
+		goto err3;
+	}
+	if (fclose(f)) {
+		warnp("fclose(%s)", tmpname);
+		goto err2;
+	}
+	if (rename(tmpname, S->fname)) {
+		warnp("rename(%s, %s)", tmpname, S->fname);
+		goto err2;
+	}
+	free(tmpname);
+
+	/* Success! */
+	return (0);
+
+err3:
+	fclose(f);
+err2:
+	unlink(tmpname);
+err1:
+	free(tmpname);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * statefile_open(fname, resume):
+ * Prepare to record "<key> <value>" pairs in the state file ${fname}.  If
+ * ${resume} is non-zero, load the values recorded by an earlier run (a
+ * missing file is not an error); otherwise, start with no values, and
+ * replace the file when the first value is recorded.
+ */
+struct statefile *
+statefile_open(const char * fname, int resume)
+{
+	struct statefile * S;
+
+	/* Allocate a structure. */
+	if ((S = malloc(sizeof(struct statefile))) == NULL)
+		goto err0;
+	if ((S->fname = strdup(fname)) == NULL)
+		goto err1;
+	S->head = NULL;
+	S->tail = &S->head;
+
+	/* Load values from an earlier run if requested. */
+	if (resume && load(S)) {
+		statefile_free(S);
+		goto err0;
+	}
+
+	/* Success! */
+	return (S);
+
+err1:
+	free(S);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * statefile_get(S, key):
+ * Return the value recorded for ${key} in ${S}, or NULL if there is none or
+ * if ${S} is NULL.
+ */
+const char *
+statefile_get(struct statefile * S, const char * key)
+{
+	struct statefile_kv * KV;
+
+	/* No state file means nothing is recorded. */
+	if (S == NULL)
+		return (NULL);
+
+	/* Look for the key. */
+	for (KV = S->head; KV != NULL; KV = KV->next) {
+		if (strcmp(KV->key, key) == 0)
+			return (KV->value);
+	}
+
+	/* Not found. */
+	return (NULL);
+}
+
+/**
+ * statefile_set(S, key, value):
+ * Record ${value} for ${key} in ${S}, replacing any earlier value, and
+ * atomically rewrite the state file.  Keys may not contain whitespace and
+ * values may not contain newlines.  If ${S} is NULL, do nothing.
+ */
+int
+statefile_set(struct statefile * S, const char * key, const char * value)
+{
+
+	/* Nothing to do if we're not keeping state. */
+	if (S == NULL)
+		return (0);
+
+	/* Record the value, then write out the file. */
+	if (put(S, key, value))
+		goto err0;
+	if (save(S))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * statefile_free(S):
+ * Free the state ${S}; the state file is left in place.
+ */
+void
+statefile_free(struct statefile * S)
+{
+	struct statefile_kv * KV;
+
+	/* Behave consistently with free(NULL). */
+	if (S == NULL)
+		return;
+
+	/* Free the recorded values. */
+	while ((KV = S->head) != NULL) {
+		S->head = KV->next;
+		free(KV->key);
+		free(KV->value);
+		free(KV);
+	}
+
+	/* Free the file name and the structure. */
+	free(S->fname);
+	free(S);
+}
@@ -0,0 +1,37 @@
+#ifndef _STATEFILE_H_
+#define _STATEFILE_H_
+
+/* Opaque type. */
+struct statefile;
+
+/**
+ * statefile_open(fname, resume):
+ * Prepare to record "<key> <value>" pairs in the state file ${fname}.  If
+ * ${resume} is non-zero, load the values recorded by an earlier run (a
+ * missing file is not an error); otherwise, start with no values, and
+ * replace the file when the first value is recorded.
+ */
+struct statefile * statefile_open(const char *, int);
+
+/**
+ * statefile_get(S, key):
+ * Return the value recorded for ${key} in ${S}, or NULL if there is none or
+ * if ${S} is NULL.
+ */
+const char * statefile_get(struct statefile *, const char *);
+
+/**
+ * statefile_set(S, key, value):
+ * Record ${value} for ${key} in ${S}, replacing any earlier value, and
+ * atomically rewrite the state file.  Keys may not contain whitespace and
+ * values may not contain newlines.  If ${S} is NULL, do nothing.
+ */
+int statefile_set(struct statefile *, const char *, const char *);
+
+/**
+ * statefile_free(S):
+ * Free the state ${S}; the state file is left in place.
+ */
+void statefile_free(struct statefile *);
+
+#endif /* !_STATEFILE_H_ */
@@ -0,0 +1,262 @@
+#include <errno.h>
+#include <lzma.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "warnp.h"
+
+#include "xzreader.h"
+
+/* Compressed data is read in pieces of this size. */
+#define INBUFLEN (1024 * 1024)
+
+struct xzreader {
+	int fd;
+	uint64_t pos;
+	int eof;
+	lzma_stream strm;
+	uint8_t * inbuf;
+};
+
+/* Return a description of the liblzma error ${ret}. */
+static const char *
+lzmaerr(lzma_ret ret)
+{
+
+	switch (ret) {
+	case LZMA_MEM_ERROR:
+		return ("Out of memory");
+	case LZMA_MEMLIMIT_ERROR:
+		return ("Memory usage limit reached");
+	case LZMA_FORMAT_ERROR:
+		return ("Not in xz format");
+	case LZMA_OPTIONS_ERROR:
+		return ("Unsupported compression options");
+	case LZMA_DATA_ERROR:
+		return ("Compressed data is corrupt");
+	case LZMA_BUF_ERROR:
+		return ("Compressed data is truncated");
+	default:
+		return ("Internal error");
+	}
+}
+
+/* Read up to ${len} bytes into ${buf} from offset ${pos} in ${fd}. */
+static ssize_t
+preadsome(int fd, uint8_t * buf, size_t len, uint64_t pos)
+{
+	ssize_t lenread;
+
+	do {
+		lenread = pread(fd, buf, len, (off_t)pos);
+	} while ((lenread == -1) && (errno == EINTR));
+
+	return (lenread);
+}
+
+/**
+ * xzreader_isxz(fd):
+ * Return 1 if the file ${fd} starts with the xz magic number, 0 if it does
+ * not, or -1 on error.
+ */
+int
+xzreader_isxz(int fd)
+{
+	static const uint8_t magic[6] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+	uint8_t buf[6];
+	ssize_t lenread;
+
+	/* Read what would be the magic number. */
+	if ((lenread = preadsome(fd, buf, 6, 0)) == -1) {
+		warnp("read");
+		return (-1);
+	}
+
+	/* Is it? */
+	return ((lenread == 6) && (memcmp(buf, magic, 6) == 0));
+}
+
+/* Read the index of the xz file ${fd} to find its decompressed size. */
+static int
+xzsize(int fd, uint8_t * inbuf, uint64_t * size)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_index * idx;
+	lzma_ret ret;
+	off_t flen;
+	uint64_t pos = 0;
+	ssize_t lenread;
+
+	/* How long is the compressed file? */
+	if ((flen = lseek(fd, 0, SEEK_END)) == -1) {
+		warnp("lseek");
+		goto err0;
+	}
+
+	/* The decoder tells us which parts of the file it needs. */
+	if ((ret = lzma_file_info_decoder(&strm, &idx, UINT64_MAX,
+	    (uint64_t)flen)) != LZMA_OK) {
+		warn0("lzma_file_info_decoder: %s", lzmaerr(ret));
+		goto err0;
+	}
+	do {
+		if (strm.avail_in == 0) {
+			if ((lenread = preadsome(fd, inbuf, INBUFLEN,
+			    pos)) == -1) {
+				warnp("read");
+				goto err1;
+			}
+			strm.next_in = inbuf;
+			strm.avail_in = (size_t)lenread;
+			pos += (uint64_t)lenread;
+		}
+		ret = lzma_code(&strm,
+		    (strm.avail_in == 0) ? LZMA_FINISH : LZMA_RUN);
+		if (ret == LZMA_SEEK_NEEDED) {
+			pos = strm.seek_pos;
+			strm.avail_in = 0;
+			ret = LZMA_OK;
+		}
+	} while (ret == LZMA_OK);
+	if (ret != LZMA_STREAM_END) {
+		warn0("Cannot read xz index: %s", lzmaerr(ret));
+		goto err1;
+	}
+
+	/* Extract the size and clean up. */
+	*size = lzma_index_uncompressed_size(idx);
+	lzma_index_end(idx, NULL);
+	lzma_end(&strm);
+
+	/* Success! */
+	return (0);
+
+err1:
+	lzma_end(&strm);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * xzreader_open(fd, size):
+ * Prepare to decompress the xz file ${fd}, using as many threads as there
+ * are CPUs if it was compressed in multiple blocks.  Set ${size} to the
+ * decompressed size recorded in the file's index.
+ */
+struct xzreader *
+xzreader_open(int fd, uint64_t * size)
+{
+	struct xzreader * X;
+	lzma_mt mt;
+	lzma_ret ret;
+
+	/* Allocate a structure and an input buffer. */
+	if ((X = malloc(sizeof(struct xzreader))) == NULL)
+		goto err0;
+	if ((X->inbuf = malloc(INBUFLEN)) == NULL)
+		goto err1;
+	X->fd = fd;
+	X->pos = 0;
+	X->eof = 0;
+
+	/* Find the decompressed size. */
+	if (xzsize(fd, X->inbuf, size))
+		goto err2;
+
+	/*
+	 * Blocks can be decompressed in parallel.  Once a thread per CPU
+	 * would use more than a quarter of RAM, fall back to fewer threads.
+	 */
+	memset(&mt, 0, sizeof(lzma_mt));
+	mt.flags = LZMA_CONCATENATED;
+	if ((mt.threads = lzma_cputhreads()) == 0)
+		mt.threads = 1;
+	mt.memlimit_threading = lzma_physmem() / 4;
+	mt.memlimit_stop = UINT64_MAX;
+	X->strm = (lzma_stream)LZMA_STREAM_INIT;
+	if ((ret = lzma_stream_decoder_mt(&X->strm, &mt)) != LZMA_OK) {
+		warn0("lzma_stream_decoder_mt: %s", lzmaerr(ret));
+		goto err2;
+	}
+
+	/* Success! */
+	return (X);
+
+err2:
+	free(X->inbuf);
+err1:
+	free(X);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * xzreader_read(X, buf, len):
+ * Decompress the next ${len} bytes from ${X} into ${buf}.  Return 0 on
+ * success or -1 on error, including if the data ends too soon.
+ */
+int
+xzreader_read(struct xzreader * X, uint8_t * buf, size_t len)
+{
+	ssize_t lenread;
+	lzma_ret ret;
+
+	/* Decompress until the buffer is full. */
+	X->strm.next_out = buf;
+	X->strm.avail_out = len;
+	while (X->strm.avail_out > 0) {
+		/* Read more compressed data if we need it. */
+		if ((X->strm.avail_in == 0) && !X->eof) {
+			if ((lenread = preadsome(X->fd, X->inbuf, INBUFLEN,
+			    X->pos)) == -1) {
+				warnp("read");
+				goto err0;
+			}
+			X->strm.next_in = X->inbuf;
+			X->strm.avail_in = (size_t)lenread;
+			X->pos += (uint64_t)lenread;
+			X->eof = (lenread == 0);
+		}
+
+		/* Decompress what we can. */
+		ret = lzma_code(&X->strm, X->eof ? LZMA_FINISH : LZMA_RUN);
+		if (ret == LZMA_STREAM_END) {
+			if (X->strm.avail_out > 0) {
+				warn0("Decompressed data is too short");
+				goto err0;
+			}
+		} else if (ret != LZMA_OK) {
+			warn0("xz decompression failed: %s", lzmaerr(ret));
+			goto err0;
+		}
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * xzreader_free(X):
+ * Free the decompressor ${X}.  The file is not closed.
+ */
+void
+xzreader_free(struct xzreader * X)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (X == NULL)
+		return;
+
+	/* Free the decoder and our buffer. */
+	lzma_end(&X->strm);
+	free(X->inbuf);
+	free(X);
+}
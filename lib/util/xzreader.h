@@ -0,0 +1,38 @@
+#ifndef _XZREADER_H_
+#define _XZREADER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Opaque type. */
+struct xzreader;
+
+/**
+ * xzreader_isxz(fd):
+ * Return 1 if the file ${fd} starts with the xz magic number, 0 if it does
+ * not, or -1 on error.
+ */
+int xzreader_isxz(int);
+
+/**
+ * xzreader_open(fd, size):
+ * Prepare to decompress the xz file ${fd}, using as many threads as there
+ * are CPUs if it was compressed in multiple blocks.  Set ${size} to the
+ * decompressed size recorded in the file's index.
+ */
+struct xzreader * xzreader_open(int, uint64_t *);
+
+/**
+ * xzreader_read(X, buf, len):
+ * Decompress the next ${len} bytes from ${X} into ${buf}.  Return 0 on
+ * success or -1 on error, including if the data ends too soon.
+ */
+int xzreader_read(struct xzreader *, uint8_t *, size_t);
+
+/**
+ * xzreader_free(X):
+ * Free the decompressor ${X}.  The file is not closed.
+ */
+void xzreader_free(struct xzreader *);
+
+#endif /* !_XZREADER_H_ */
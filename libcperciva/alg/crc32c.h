@@ -0,0 +1,38 @@
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Context structure for CRC32C operations. */
+typedef struct {
+	uint32_t state;
+} CRC32C_CTX;
+
+/**
+ * CRC32C_Init(ctx):
+ * Initialize the CRC32C context ${ctx}.
+ */
+void CRC32C_Init(CRC32C_CTX *);
+
+/**
+ * CRC32C_Update(ctx, in, len):
+ * Input ${len} bytes from ${in} into the CRC32C context ${ctx}.
+ */
+void CRC32C_Update(CRC32C_CTX *, const uint8_t *, size_t);
+
+/**
+ * CRC32C_Final(cbuf, ctx):
+ * Output the CRC32C of the data input to the context ${ctx} into the buffer
+ * ${cbuf}, in big-endian order.
+ */
+void CRC32C_Final(uint8_t[4], CRC32C_CTX *);
+
+/**
+ * CRC32C_Buf(in, len, cbuf):
+ * Compute the CRC32C of ${len} bytes from ${in} and write it to ${cbuf}, in
+ * big-endian order.
+ */
+void CRC32C_Buf(const uint8_t *, size_t, uint8_t[4]);
+
+#endif /* !_CRC32C_H_ */
@@ -0,0 +1,34 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_ARM_CRC32_64
+#include <arm_acle.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c_arm.h"
+
+/**
+ * CRC32C_Update_arm(state, in, len):
+ * Return the CRC32C register ${state} updated with ${len} bytes from ${in}.
+ * This implementation uses the ARMv8 CRC32 instructions, and must only be
+ * used if cpusupport_arm_crc32_64() returns non-zero.
+ */
+uint32_t
+CRC32C_Update_arm(uint32_t state, const uint8_t * in, size_t len)
+{
+	uint64_t w;
+
+	/* Process 8 bytes at a time. */
+	for (; len >= 8; in += 8, len -= 8) {
+		memcpy(&w, in, 8);
+		state = __crc32cd(state, w);
+	}
+
+	/* Process any remaining bytes. */
+	for (; len > 0; in++, len--)
+		state = __crc32cb(state, *in);
+
+	return (state);
+}
+#endif /* CPUSUPPORT_ARM_CRC32_64 */
@@ -0,0 +1,15 @@
+#ifndef _CRC32C_ARM_H_
+#define _CRC32C_ARM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC32C_Update_arm(state, in, len):
+ * Return the CRC32C register ${state} updated with ${len} bytes from ${in}.
+ * This implementation uses the ARMv8 CRC32 instructions, and must only be
+ * used if cpusupport_arm_crc32_64() returns non-zero.
+ */
+uint32_t CRC32C_Update_arm(uint32_t, const uint8_t *, size_t);
+
+#endif /* !_CRC32C_ARM_H_ */
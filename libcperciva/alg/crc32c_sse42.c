@@ -0,0 +1,46 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_X86_CRC32_64
+#include <nmmintrin.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c_sse42.h"
+
+/**
+ * CRC32C_Update_sse42(state, in, len):
+ * Return the CRC32C register ${state} updated with ${len} bytes from ${in}.
+ * This implementation uses the SSE4.2 CRC32 instruction, and must only be
+ * used if cpusupport_x86_crc32_64() returns non-zero.
+ */
+uint32_t
+CRC32C_Update_sse42(uint32_t state, const uint8_t * in, size_t len)
+{
+#if defined(__x86_64__)
+	uint64_t w;
+	uint64_t crc = state;
+
+	/* Process 8 bytes at a time. */
+	for (; len >= 8; in += 8, len -= 8) {
+		memcpy(&w, in, 8);
+		crc = _mm_crc32_u64(crc, w);
+	}
+	state = (uint32_t)crc;
+#else
+	uint32_t w;
+
+	/* Process 4 bytes at a time. */
+	for (; len >= 4; in += 4, len -= 4) {
+		memcpy(&w, in, 4);
+		state = _mm_crc32_u32(state, w);
+	}
+#endif
+
+	/* Process any remaining bytes. */
+	for (; len > 0; in++, len--)
+		state = _mm_crc32_u8(state, *in);
+
+	return (state);
+}
+#endif /* CPUSUPPORT_X86_CRC32_64 */
@@ -0,0 +1,15 @@
+#ifndef _CRC32C_SSE42_H_
+#define _CRC32C_SSE42_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC32C_Update_sse42(state, in, len):
+ * Return the CRC32C register ${state} updated with ${len} bytes from ${in}.
+ * This implementation uses the SSE4.2 CRC32 instruction, and must only be
+ * used if cpusupport_x86_crc32_64() returns non-zero.
+ */
+uint32_t CRC32C_Update_sse42(uint32_t, const uint8_t *, size_t);
+
+#endif /* !_CRC32C_SSE42_H_ */
@@ -1,12 +1,32 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 
+#include "cpusupport.h"
 #include "insecure_memzero.h"
+#include "sha256_arm.h"
+#include "sha256_shani.h"
+#include "sha256_sse2.h"
 #include "sysendian.h"
 
 #include "sha256.h"
 
+#if defined(CPUSUPPORT_X86_SHANI) || defined(CPUSUPPORT_X86_SSE2) ||	\
+    defined(CPUSUPPORT_ARM_SHA256)
+#define HWACCEL
+
+/* Which SHA256_Transform implementation to use. */
+static enum {
+	HW_SOFTWARE = 0,
+	HW_X86_SHANI,
+	HW_X86_SSE2,
+	HW_ARM_SHA256,
+	HW_UNSET
+} hwaccel = HW_UNSET;
+static pthread_once_t hwaccel_once = PTHREAD_ONCE_INIT;
+#endif
+
 /*
  * Encode a length len/4 vector of (uint32_t) into a length len vector of
  * (uint8_t) in big-endian form.  Assumes len is a multiple of 4.
@@ -91,10 +111,11 @@ static const uint32_t Krnd[64] = {
 
 /*
  * SHA256 block compression function.  The 256-bit state is transformed via
- * the 512-bit input block to produce a new state.
+ * the 512-bit input block to produce a new state.  This is the portable
+ * implementation.
  */
 static void
-SHA256_Transform(uint32_t state[static restrict 8],
+SHA256_Transform_sw(uint32_t state[static restrict 8],
     const uint8_t block[static restrict 64],
     uint32_t W[static restrict 64], uint32_t S[static restrict 8])
 {
@@ -150,6 +171,137 @@ SHA256_Transform(uint32_t state[static restrict 8],
 		state[i] += S[i];
 }
 
+#ifdef HWACCEL
+/*
+ * Test whether the hardware-accelerated implementation ${hw} produces the
+ * same results as the portable implementation.  Return non-zero on
+ * mismatch.
+ */
+static int
+hwtest(const uint32_t state[static restrict 8],
+    const uint8_t block[static restrict 64],
+    uint32_t W[static restrict 64], uint32_t S[static restrict 8], int hw)
+{
+	uint32_t state_sw[8];
+	uint32_t state_hw[8];
+
+	/* Transform the state using the portable code. */
+	memcpy(state_sw, state, sizeof(state_sw));
+	SHA256_Transform_sw(state_sw, block, W, S);
+
+	/* Transform the state using the hardware-accelerated code. */
+	memcpy(state_hw, state, sizeof(state_hw));
+	switch (hw) {
+#ifdef CPUSUPPORT_X86_SHANI
+	case HW_X86_SHANI:
+		SHA256_Transform_shani(state_hw, block);
+		break;
+#endif
+#ifdef CPUSUPPORT_X86_SSE2
+	case HW_X86_SSE2:
+		SHA256_Transform_sse2(state_hw, block, W, S);
+		break;
+#endif
+#ifdef CPUSUPPORT_ARM_SHA256
+	case HW_ARM_SHA256:
+		SHA256_Transform_arm(state_hw, block);
+		break;
+#endif
+	}
+
+	/* Do the results match? */
+	return (memcmp(state_sw, state_hw, sizeof(state_sw)));
+}
+
+/*
+ * Figure out which SHA256_Transform implementation to use: the first one
+ * (in order of decreasing speed) which the CPU supports and which passes a
+ * self-test against the portable implementation.
+ */
+static void
+hwaccel_pick(void)
+{
+	uint32_t state[8];
+	uint8_t block[64];
+	uint32_t W[64];
+	uint32_t S[8];
+	int hw = HW_SOFTWARE;
+	size_t i;
+
+	/* Construct a test state and block with no special structure. */
+	for (i = 0; i < 8; i++)
+		state[i] = Krnd[i] ^ Krnd[i + 8];
+	for (i = 0; i < 64; i++)
+		block[i] = (uint8_t)(i * 73 + 5);
+
+	/* Test each implementation which the CPU claims to support. */
+	if ((hw == HW_SOFTWARE) && cpusupport_x86_shani() &&
+	    !hwtest(state, block, W, S, HW_X86_SHANI))
+		hw = HW_X86_SHANI;
+	if ((hw == HW_SOFTWARE) && cpusupport_arm_sha256() &&
+	    !hwtest(state, block, W, S, HW_ARM_SHA256))
+		hw = HW_ARM_SHA256;
+	if ((hw == HW_SOFTWARE) && cpusupport_x86_sse2() &&
+	    !hwtest(state, block, W, S, HW_X86_SSE2))
+		hw = HW_X86_SSE2;
+
+	/* Clean the stack. */
+	insecure_memzero(W, sizeof(W));
+	insecure_memzero(S, sizeof(S));
+
+	/* Record our decision. */
+	hwaccel = hw;
+}
+
+/*
+ * Return the SHA256_Transform implementation to use, deciding on the first
+ * call; other threads calling at the same time wait for the decision.  If
+ * we can't decide, the portable implementation will be used.
+ */
+static int
+hwaccel_init(void)
+{
+
+	(void)pthread_once(&hwaccel_once, hwaccel_pick);
+	return (hwaccel);
+}
+#endif /* HWACCEL */
+
+/*
+ * SHA256 block compression function.  The 256-bit state is transformed via
+ * the 512-bit input block to produce a new state.  Use hardware acceleration
+ * if it is available.
+ */
+static void
+SHA256_Transform(uint32_t state[static restrict 8],
+    const uint8_t block[static restrict 64],
+    uint32_t W[static restrict 64], uint32_t S[static restrict 8])
+{
+
+#ifdef HWACCEL
+	switch (hwaccel_init()) {
+#ifdef CPUSUPPORT_X86_SHANI
+	case HW_X86_SHANI:
+		SHA256_Transform_shani(state, block);
+		return;
+#endif
+#ifdef CPUSUPPORT_X86_SSE2
+	case HW_X86_SSE2:
+		SHA256_Transform_sse2(state, block, W, S);
+		return;
+#endif
+#ifdef CPUSUPPORT_ARM_SHA256
+	case HW_ARM_SHA256:
+		SHA256_Transform_arm(state, block);
+		return;
+#endif
+	}
+#endif
+
+	/* Fall back to the portable implementation. */
+	SHA256_Transform_sw(state, block, W, S);
+}
+
 static const uint8_t PAD[64] = {
 	0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
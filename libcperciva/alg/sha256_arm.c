@@ -0,0 +1,88 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_ARM_SHA256
+#include <arm_neon.h>
+#include <stdint.h>
+
+#include "sha256_arm.h"
+
+/* SHA256 round constants. */
+static const uint32_t Krnd[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Four rounds, using message words ${M} and round constants from ${i}. */
+#define RND4(M, i) do {					\
+	uint32x4_t MK = vaddq_u32(M, vld1q_u32(&Krnd[i]));	\
+	uint32x4_t ABCD = STATE0;				\
+	STATE0 = vsha256hq_u32(STATE0, STATE1, MK);		\
+	STATE1 = vsha256h2q_u32(STATE1, ABCD, MK);		\
+} while (0)
+
+/* Replace ${M0} with the message words which follow ${M3}. */
+#define MSCH4(M0, M1, M2, M3)					\
+	M0 = vsha256su1q_u32(vsha256su0q_u32(M0, M1), M2, M3)
+
+/* Load four big-endian message words from ${p}. */
+#define LOADBE(p)	vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p)))
+
+/**
+ * SHA256_Transform_arm(state, block):
+ * Compute the SHA256 block compression function, transforming ${state} using
+ * the data in ${block}.  This implementation uses ARMv8 SHA256 instructions,
+ * and must only be used if cpusupport_arm_sha256() returns non-zero.
+ */
+void
+SHA256_Transform_arm(uint32_t state[static restrict 8],
+    const uint8_t block[static restrict 64])
+{
+	uint32x4_t STATE0, STATE1;
+	uint32x4_t M0, M1, M2, M3;
+	int i;
+
+	/* Load the state and the message. */
+	STATE0 = vld1q_u32(&state[0]);
+	STATE1 = vld1q_u32(&state[4]);
+	M0 = LOADBE(&block[0]);
+	M1 = LOADBE(&block[16]);
+	M2 = LOADBE(&block[32]);
+	M3 = LOADBE(&block[48]);
+
+	/* Rounds 0-47, computing message words for rounds 16-63. */
+	for (i = 0; i < 48; i += 16) {
+		RND4(M0, i);
+		MSCH4(M0, M1, M2, M3);
+		RND4(M1, i + 4);
+		MSCH4(M1, M2, M3, M0);
+		RND4(M2, i + 8);
+		MSCH4(M2, M3, M0, M1);
+		RND4(M3, i + 12);
+		MSCH4(M3, M0, M1, M2);
+	}
+
+	/* Rounds 48-63. */
+	RND4(M0, 48);
+	RND4(M1, 52);
+	RND4(M2, 56);
+	RND4(M3, 60);
+
+	/* Add the transformed state into the original state. */
+	vst1q_u32(&state[0], vaddq_u32(STATE0, vld1q_u32(&state[0])));
+	vst1q_u32(&state[4], vaddq_u32(STATE1, vld1q_u32(&state[4])));
+}
+#endif /* CPUSUPPORT_ARM_SHA256 */
@@ -0,0 +1,15 @@
+#ifndef _SHA256_ARM_H_
+#define _SHA256_ARM_H_
+
+#include <stdint.h>
+
+/**
+ * SHA256_Transform_arm(state, block):
+ * Compute the SHA256 block compression function, transforming ${state} using
+ * the data in ${block}.  This implementation uses ARMv8 SHA256 instructions,
+ * and must only be used if cpusupport_arm_sha256() returns non-zero.
+ */
+void SHA256_Transform_arm(uint32_t[static restrict 8],
+    const uint8_t[static restrict 64]);
+
+#endif /* !_SHA256_ARM_H_ */
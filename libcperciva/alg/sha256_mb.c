@@ -0,0 +1,204 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cpusupport.h"
+#include "insecure_memzero.h"
+#include "sha256.h"
+#include "sha256_mb_x86.h"
+
+#include "sha256_mb.h"
+
+/* A multi-lane SHA256 block compression function. */
+typedef void transform_mb(uint32_t *, const uint8_t * const *, size_t);
+
+/* Available implementations, widest first. */
+static const struct {
+	size_t lanes;
+	transform_mb * transform;
+	int (* cpusupport)(void);
+} impls[] = {
+#ifdef CPUSUPPORT_X86_AVX512F
+	{ 16, SHA256_Transform_mb16, cpusupport_x86_avx512f },
+#endif
+#ifdef CPUSUPPORT_X86_AVX2
+	{ 8, SHA256_Transform_mb8, cpusupport_x86_avx2 },
+#endif
+#ifdef CPUSUPPORT_X86_SSE2
+	{ 4, SHA256_Transform_mb4, cpusupport_x86_sse2 },
+#endif
+	{ 1, NULL, NULL }
+};
+
+/*
+ * Which implementation to use, as an index into impls[].  This is decided
+ * once, by the first thread which needs to know.
+ */
+static int impl = -1;
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Hash ${n} <= ${lanes} buffers using ${transform}: process as many blocks
+ * as all of the buffers have in lockstep, then finish each buffer on its
+ * own.
+ */
+static void
+hash_lanes(size_t lanes, transform_mb * transform,
+    const uint8_t * const * in, const size_t * len, uint8_t (* digests)[32],
+    size_t n)
+{
+	const uint8_t * lanein[SHA256_MB_MAXLANES];
+	uint32_t state[8 * SHA256_MB_MAXLANES];
+	SHA256_CTX ctx;
+	size_t nblocks;
+	size_t i, j;
+
+	/* How many blocks do all of the buffers have? */
+	for (nblocks = SIZE_MAX, j = 0; j < n; j++) {
+		if (len[j] / 64 < nblocks)
+			nblocks = len[j] / 64;
+	}
+
+	/* Set up every lane; spare lanes repeat the first buffer. */
+	SHA256_Init(&ctx);
+	for (j = 0; j < lanes; j++) {
+		lanein[j] = in[(j < n) ? j : 0];
+		for (i = 0; i < 8; i++)
+			state[i * lanes + j] = ctx.state[i];
+	}
+
+	/* Process the blocks which all of the buffers have. */
+	if (nblocks > 0)
+		(transform)(state, lanein, nblocks);
+
+	/* Finish each buffer on its own. */
+	for (j = 0; j < n; j++) {
+		for (i = 0; i < 8; i++)
+			ctx.state[i] = state[i * lanes + j];
+		ctx.count = (uint64_t)(nblocks * 64) << 3;
+		SHA256_Update(&ctx, &in[j][nblocks * 64],
+		    len[j] - nblocks * 64);
+		SHA256_Final(digests[j], &ctx);
+	}
+
+	/* Clean the stack. */
+	insecure_memzero(state, sizeof(state));
+	insecure_memzero(&ctx, sizeof(SHA256_CTX));
+}
+
+/*
+ * Test whether implementation ${k} produces the same results as hashing
+ * buffers one at a time.  Return non-zero on mismatch.
+ */
+static int
+mbtest(int k)
+{
+	uint8_t buf[SHA256_MB_MAXLANES][200 + SHA256_MB_MAXLANES];
+	const uint8_t * in[SHA256_MB_MAXLANES];
+	size_t len[SHA256_MB_MAXLANES];
+	uint8_t digests[SHA256_MB_MAXLANES][32];
+	uint8_t digest[32];
+	size_t i, j;
+
+	/* Generate buffers of different lengths with no special structure. */
+	for (j = 0; j < SHA256_MB_MAXLANES; j++) {
+		for (i = 0; i < sizeof(buf[j]); i++)
+			buf[j][i] = (uint8_t)(i * 73 + j * 29 + 5);
+		in[j] = buf[j];
+		len[j] = 200 + j;
+	}
+
+	/* Hash them all at once. */
+	hash_lanes(impls[k].lanes, impls[k].transform, in, len, digests,
+	    impls[k].lanes);
+
+	/* Check each hash. */
+	for (j = 0; j < impls[k].lanes; j++) {
+		SHA256_Buf(in[j], len[j], digest);
+		if (memcmp(digest, digests[j], 32))
+			return (1);
+	}
+
+	/* Everything matched. */
+	return (0);
+}
+
+/* Pick the widest implementation which works. */
+static void
+mb_pick(void)
+{
+	int shainsns;
+	int k;
+
+	/*
+	 * Find the widest implementation which the CPU supports and which
+	 * works.  SHA256 instructions hash a single buffer faster than SIMD
+	 * instructions narrower than 16 lanes can hash several buffers.
+	 */
+	shainsns = cpusupport_x86_shani() || cpusupport_arm_sha256();
+	for (k = 0; impls[k].lanes > 1; k++) {
+		if (shainsns && (impls[k].lanes < 16))
+			continue;
+		if (impls[k].cpusupport() && !mbtest(k))
+			break;
+	}
+
+	/* Record our decision. */
+	impl = k;
+}
+
+/*
+ * Return the implementation to use, deciding on the first call.  If we
+ * can't decide, fall back to hashing buffers one at a time.
+ */
+static int
+mb_init(void)
+{
+
+	if (pthread_once(&impl_once, mb_pick) || (impl == -1))
+		return ((int)(sizeof(impls) / sizeof(impls[0])) - 1);
+	return (impl);
+}
+
+/**
+ * SHA256_mb_lanes(void):
+ * Return the number of buffers which SHA256_Buf_mb() hashes at once, or 1
+ * if it would hash them one at a time (e.g., because the CPU has SHA256
+ * instructions, which are usually faster than hashing buffers in parallel).
+ */
+size_t
+SHA256_mb_lanes(void)
+{
+
+	return (impls[mb_init()].lanes);
+}
+
+/**
+ * SHA256_Buf_mb(in, len, digests, n):
+ * Compute the SHA256 hashes of the ${n} buffers ${in}[i] of lengths
+ * ${len}[i], and write them to ${digests}[i].  Buffers are hashed in
+ * parallel using SIMD instructions if possible; this is most efficient when
+ * the buffers have similar lengths.
+ */
+void
+SHA256_Buf_mb(const uint8_t * const * in, const size_t * len,
+    uint8_t (* digests)[32], size_t n)
+{
+	int k = mb_init();
+	size_t lanes = impls[k].lanes;
+	size_t i;
+
+	/* Without a multi-lane implementation, hash one buffer at a time. */
+	if (lanes == 1) {
+		for (i = 0; i < n; i++)
+			SHA256_Buf(in[i], len[i], digests[i]);
+		return;
+	}
+
+	/* Hash up to ${lanes} buffers at once. */
+	for (i = 0; i < n; i += lanes) {
+		hash_lanes(lanes, impls[k].transform, &in[i], &len[i],
+		    &digests[i], (n - i < lanes) ? n - i : lanes);
+	}
+}
@@ -0,0 +1,28 @@
+#ifndef _SHA256_MB_H_
+#define _SHA256_MB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The largest value which SHA256_mb_lanes() can return. */
+#define SHA256_MB_MAXLANES 16
+
+/**
+ * SHA256_mb_lanes(void):
+ * Return the number of buffers which SHA256_Buf_mb() hashes at once, or 1
+ * if it would hash them one at a time (e.g., because the CPU has SHA256
+ * instructions, which are usually faster than hashing buffers in parallel).
+ */
+size_t SHA256_mb_lanes(void);
+
+/**
+ * SHA256_Buf_mb(in, len, digests, n):
+ * Compute the SHA256 hashes of the ${n} buffers ${in}[i] of lengths
+ * ${len}[i], and write them to ${digests}[i].  Buffers are hashed in
+ * parallel using SIMD instructions if possible; this is most efficient when
+ * the buffers have similar lengths.
+ */
+void SHA256_Buf_mb(const uint8_t * const *, const size_t *, uint8_t (*)[32],
+    size_t);
+
+#endif /* !_SHA256_MB_H_ */
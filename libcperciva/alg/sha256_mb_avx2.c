@@ -0,0 +1,11 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_X86_AVX2
+#include "sha256_mb_x86.h"
+
+/* Hash 8 messages at once using AVX2 instructions. */
+#define LANES		8
+#define SHA256_MB_FUNC	SHA256_Transform_mb8
+
+#include "sha256_mb_lanes.h"
+#endif /* CPUSUPPORT_X86_AVX2 */
@@ -0,0 +1,11 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_X86_AVX512F
+#include "sha256_mb_x86.h"
+
+/* Hash 16 messages at once using AVX-512F instructions. */
+#define LANES		16
+#define SHA256_MB_FUNC	SHA256_Transform_mb16
+
+#include "sha256_mb_lanes.h"
+#endif /* CPUSUPPORT_X86_AVX512F */
@@ -0,0 +1,122 @@
+/*
+ * Multi-lane SHA256 block compression, which hashes LANES independent
+ * messages in lockstep using the compiler's generic vector types.  This
+ * file is included by sha256_mb_*.c, which define LANES and SHA256_MB_FUNC
+ * and are compiled with flags enabling the appropriate vector instructions.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "insecure_memzero.h"
+#include "sysendian.h"
+
+/* A vector holding one 32-bit word from each lane. */
+typedef uint32_t VEC __attribute__((vector_size(4 * LANES)));
+
+/* SHA256 round constants. */
+static const uint32_t Krnd[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Elementary functions used by SHA256, applied to each lane. */
+#define Ch(x, y, z)	((x & (y ^ z)) ^ z)
+#define Maj(x, y, z)	((x & (y | z)) | (y & z))
+#define SHR(x, n)	(x >> n)
+#define ROTR(x, n)	((x >> n) | (x << (32 - n)))
+#define S0(x)		(ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define S1(x)		(ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define s0(x)		(ROTR(x, 7) ^ ROTR(x, 18) ^ SHR(x, 3))
+#define s1(x)		(ROTR(x, 17) ^ ROTR(x, 19) ^ SHR(x, 10))
+
+/**
+ * SHA256_MB_FUNC(state, in, nblocks):
+ * Transform the LANES states interleaved in ${state} (word i of lane j is
+ * ${state}[i * LANES + j]) using ${nblocks} consecutive 64-byte blocks from
+ * each of the LANES buffers ${in}[j].
+ */
+void
+SHA256_MB_FUNC(uint32_t state[static restrict 8 * LANES],
+    const uint8_t * const in[static restrict LANES], size_t nblocks)
+{
+	VEC S[8];
+	VEC W[64];
+	VEC a, b, c, d, e, f, g, h, T1, T2;
+	size_t blk;
+	int i, j;
+
+	/* Load the states. */
+	for (i = 0; i < 8; i++)
+		memcpy(&S[i], &state[i * LANES], sizeof(VEC));
+
+	/* Process each block. */
+	for (blk = 0; blk < nblocks; blk++) {
+		/* 1. Prepare the message schedule W. */
+		for (i = 0; i < 16; i++) {
+			for (j = 0; j < LANES; j++)
+				W[i][j] = be32dec(&in[j][blk * 64 + i * 4]);
+		}
+		for (i = 16; i < 64; i++) {
+			W[i] = s1(W[i - 2]) + W[i - 7] +
+			    s0(W[i - 15]) + W[i - 16];
+		}
+
+		/* 2. Initialize working variables. */
+		a = S[0];
+		b = S[1];
+		c = S[2];
+		d = S[3];
+		e = S[4];
+		f = S[5];
+		g = S[6];
+		h = S[7];
+
+		/* 3. Mix. */
+		for (i = 0; i < 64; i++) {
+			T1 = h + S1(e) + Ch(e, f, g) + Krnd[i] + W[i];
+			T2 = S0(a) + Maj(a, b, c);
+			h = g;
+			g = f;
+			f = e;
+			e = d + T1;
+			d = c;
+			c = b;
+			b = a;
+			a = T1 + T2;
+		}
+
+		/* 4. Mix local working variables into the states. */
+		S[0] += a;
+		S[1] += b;
+		S[2] += c;
+		S[3] += d;
+		S[4] += e;
+		S[5] += f;
+		S[6] += g;
+		S[7] += h;
+	}
+
+	/* Store the states. */
+	for (i = 0; i < 8; i++)
+		memcpy(&state[i * LANES], &S[i], sizeof(VEC));
+
+	/* Clean the stack. */
+	insecure_memzero(W, sizeof(W));
+	insecure_memzero(S, sizeof(S));
+}
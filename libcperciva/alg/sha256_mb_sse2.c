@@ -0,0 +1,11 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_X86_SSE2
+#include "sha256_mb_x86.h"
+
+/* Hash 4 messages at once using SSE2 instructions. */
+#define LANES		4
+#define SHA256_MB_FUNC	SHA256_Transform_mb4
+
+#include "sha256_mb_lanes.h"
+#endif /* CPUSUPPORT_X86_SSE2 */
@@ -0,0 +1,25 @@
+#ifndef _SHA256_MB_X86_H_
+#define _SHA256_MB_X86_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * SHA256_Transform_mb4(state, in, nblocks):
+ * SHA256_Transform_mb8(state, in, nblocks):
+ * SHA256_Transform_mb16(state, in, nblocks):
+ * Transform the N states interleaved in ${state} (word i of lane j is
+ * ${state}[i * N + j]) using ${nblocks} consecutive 64-byte blocks from each
+ * of the N buffers ${in}[j], where N is 4, 8, or 16.  These use SSE2, AVX2,
+ * and AVX-512F instructions respectively, and must only be used if
+ * cpusupport_x86_sse2(), cpusupport_x86_avx2(), or cpusupport_x86_avx512f()
+ * returns non-zero.
+ */
+void SHA256_Transform_mb4(uint32_t[static restrict 32],
+    const uint8_t * const[static restrict 4], size_t);
+void SHA256_Transform_mb8(uint32_t[static restrict 64],
+    const uint8_t * const[static restrict 8], size_t);
+void SHA256_Transform_mb16(uint32_t[static restrict 128],
+    const uint8_t * const[static restrict 16], size_t);
+
+#endif /* !_SHA256_MB_X86_H_ */
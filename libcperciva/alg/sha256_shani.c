@@ -0,0 +1,125 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_X86_SHANI
+#include <immintrin.h>
+#include <stdint.h>
+
+#include "sha256_shani.h"
+
+/* SHA256 round constants, in the order in which they are used. */
+static const uint32_t Krnd[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Four rounds, using message words ${M} and round constants from ${i}. */
+#define RND4(M, i) do {						\
+	__m128i MK;						\
+	MK = _mm_load_si128((const __m128i *)&Krnd[i]);		\
+	MK = _mm_add_epi32(M, MK);				\
+	STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MK);	\
+	MK = _mm_shuffle_epi32(MK, 0x0E);			\
+	STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MK);	\
+} while (0)
+
+/*
+ * Finish computing the next four message words in ${M0} (which must have
+ * been started with _mm_sha256msg1_epu32), given the last eight words in
+ * ${M2} and ${M3}.
+ */
+#define MSCH4(M0, M2, M3)					\
+	M0 = _mm_sha256msg2_epu32(_mm_add_epi32(M0,		\
+	    _mm_alignr_epi8(M3, M2, 4)), M3)
+
+/**
+ * SHA256_Transform_shani(state, block):
+ * Compute the SHA256 block compression function, transforming ${state} using
+ * the data in ${block}.  This implementation uses x86 SHA extensions, and
+ * must only be used if cpusupport_x86_shani() returns non-zero.
+ */
+void
+SHA256_Transform_shani(uint32_t state[static restrict 8],
+    const uint8_t block[static restrict 64])
+{
+	const __m128i BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	    0x0405060700010203ULL);
+	__m128i STATE0, STATE1, ABEF, CDGH;
+	__m128i M0, M1, M2, M3;
+	__m128i T;
+	int i;
+
+	/* Rearrange the state from ABCD EFGH into ABEF CDGH. */
+	T = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]),
+	    0xB1);
+	STATE1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]),
+	    0x1B);
+	STATE0 = _mm_alignr_epi8(T, STATE1, 8);
+	STATE1 = _mm_blend_epi16(STATE1, T, 0xF0);
+	ABEF = STATE0;
+	CDGH = STATE1;
+
+	/* Rounds 0-15 use the message words from the block. */
+	M0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&block[0]),
+	    BSWAP);
+	RND4(M0, 0);
+	M1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&block[16]),
+	    BSWAP);
+	RND4(M1, 4);
+	M0 = _mm_sha256msg1_epu32(M0, M1);
+	M2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&block[32]),
+	    BSWAP);
+	RND4(M2, 8);
+	M1 = _mm_sha256msg1_epu32(M1, M2);
+	M3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&block[48]),
+	    BSWAP);
+	RND4(M3, 12);
+	MSCH4(M0, M2, M3);
+	M2 = _mm_sha256msg1_epu32(M2, M3);
+
+	/*
+	 * Rounds 16-63 use message words computed four at a time.  The
+	 * final iteration computes a few words which we don't need; this
+	 * is harmless, and cheaper than checking for it.
+	 */
+	for (i = 16; i < 64; i += 16) {
+		RND4(M0, i);
+		MSCH4(M1, M3, M0);
+		M3 = _mm_sha256msg1_epu32(M3, M0);
+		RND4(M1, i + 4);
+		MSCH4(M2, M0, M1);
+		M0 = _mm_sha256msg1_epu32(M0, M1);
+		RND4(M2, i + 8);
+		MSCH4(M3, M1, M2);
+		M1 = _mm_sha256msg1_epu32(M1, M2);
+		RND4(M3, i + 12);
+		MSCH4(M0, M2, M3);
+		M2 = _mm_sha256msg1_epu32(M2, M3);
+	}
+
+	/* Add the original state back in. */
+	STATE0 = _mm_add_epi32(STATE0, ABEF);
+	STATE1 = _mm_add_epi32(STATE1, CDGH);
+
+	/* Rearrange the state from ABEF CDGH back into ABCD EFGH. */
+	T = _mm_shuffle_epi32(STATE0, 0x1B);
+	STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);
+	STATE0 = _mm_blend_epi16(T, STATE1, 0xF0);
+	STATE1 = _mm_alignr_epi8(STATE1, T, 8);
+	_mm_storeu_si128((__m128i *)&state[0], STATE0);
+	_mm_storeu_si128((__m128i *)&state[4], STATE1);
+}
+#endif /* CPUSUPPORT_X86_SHANI */
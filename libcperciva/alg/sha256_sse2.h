@@ -0,0 +1,18 @@
+#ifndef _SHA256_SSE2_H_
+#define _SHA256_SSE2_H_
+
+#include <stdint.h>
+
+/**
+ * SHA256_Transform_sse2(state, block, W, S):
+ * Compute the SHA256 block compression function, transforming ${state} using
+ * the data in ${block}.  This implementation uses x86 SSE2 instructions to
+ * compute the message schedule, and must only be used if
+ * cpusupport_x86_sse2() returns non-zero.  The arrays W and S may be filled
+ * with sensitive data, and should be cleared by the caller.
+ */
+void SHA256_Transform_sse2(uint32_t[static restrict 8],
+    const uint8_t[static restrict 64], uint32_t W[static restrict 64],
+    uint32_t S[static restrict 8]);
+
+#endif /* !_SHA256_SSE2_H_ */
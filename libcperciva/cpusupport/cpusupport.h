@@ -0,0 +1,83 @@
+#ifndef _CPUSUPPORT_H_
+#define _CPUSUPPORT_H_
+
+/*
+ * The Makefile defines CPUSUPPORT_<ARCH>_<FEATURE> when building for an
+ * architecture where the compiler can generate code which uses <FEATURE>;
+ * the function cpusupport_<arch>_<feature>() reports whether the CPU we are
+ * running on actually supports it.  If the feature is not enabled at build
+ * time, the function is replaced by a macro which always returns 0.
+ */
+
+#ifdef CPUSUPPORT_X86_SSE2
+/**
+ * cpusupport_x86_sse2(void):
+ * Return non-zero if the CPU supports SSE2.
+ */
+int cpusupport_x86_sse2(void);
+#else
+#define cpusupport_x86_sse2() (0)
+#endif
+
+#ifdef CPUSUPPORT_X86_AVX2
+/**
+ * cpusupport_x86_avx2(void):
+ * Return non-zero if the CPU and operating system support AVX2.
+ */
+int cpusupport_x86_avx2(void);
+#else
+#define cpusupport_x86_avx2() (0)
+#endif
+
+#ifdef CPUSUPPORT_X86_AVX512F
+/**
+ * cpusupport_x86_avx512f(void):
+ * Return non-zero if the CPU and operating system support AVX-512F.
+ */
+int cpusupport_x86_avx512f(void);
+#else
+#define cpusupport_x86_avx512f() (0)
+#endif
+
+#ifdef CPUSUPPORT_X86_CRC32_64
+/**
+ * cpusupport_x86_crc32_64(void):
+ * Return non-zero if the CPU supports the SSE4.2 CRC32 instruction.
+ */
+int cpusupport_x86_crc32_64(void);
+#else
+#define cpusupport_x86_crc32_64() (0)
+#endif
+
+#ifdef CPUSUPPORT_X86_SHANI
+/**
+ * cpusupport_x86_shani(void):
+ * Return non-zero if the CPU supports the SHA extensions, along with the
+ * SSSE3 and SSE4.1 instructions which are needed to make use of them.
+ */
+int cpusupport_x86_shani(void);
+#else
+#define cpusupport_x86_shani() (0)
+#endif
+
+#ifdef CPUSUPPORT_ARM_CRC32_64
+/**
+ * cpusupport_arm_crc32_64(void):
+ * Return non-zero if the CPU supports the ARMv8 CRC32 instructions.
+ */
+int cpusupport_arm_crc32_64(void);
+#else
+#define cpusupport_arm_crc32_64() (0)
+#endif
+
+#ifdef CPUSUPPORT_ARM_SHA256
+/**
+ * cpusupport_arm_sha256(void):
+ * Return non-zero if the CPU supports the ARMv8 SHA256 instructions.
+ */
+int cpusupport_arm_sha256(void);
+#else
+#define cpusupport_arm_sha256() (0)
+#endif
+
+#endif /* !_CPUSUPPORT_H_ */
@@ -0,0 +1,40 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_ARM_CRC32_64
+#include <sys/auxv.h>
+
+#if defined(__FreeBSD__)
+#include <machine/elf.h>
+#elif defined(__linux__)
+#include <asm/hwcap.h>
+#endif
+
+/* Cached result of feature detection. */
+static int crc32_64_present = -1;
+
+/**
+ * cpusupport_arm_crc32_64(void):
+ * Return non-zero if the CPU supports the ARMv8 CRC32 instructions.
+ */
+int
+cpusupport_arm_crc32_64(void)
+{
+	unsigned long hwcap = 0;
+
+	/* Have we already checked? */
+	if (crc32_64_present != -1)
+		return (crc32_64_present);
+
+	/* Ask the kernel which instructions the CPU supports. */
+#if defined(__FreeBSD__)
+	if (elf_aux_info(AT_HWCAP, &hwcap, sizeof(hwcap)))
+		hwcap = 0;
+#elif defined(__linux__)
+	hwcap = getauxval(AT_HWCAP);
+#endif
+	crc32_64_present = (hwcap & HWCAP_CRC32) ? 1 : 0;
+
+	/* Return the cached value. */
+	return (crc32_64_present);
+}
+#endif /* CPUSUPPORT_ARM_CRC32_64 */
@@ -0,0 +1,40 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_ARM_SHA256
+#include <sys/auxv.h>
+
+#if defined(__FreeBSD__)
+#include <machine/elf.h>
+#elif defined(__linux__)
+#include <asm/hwcap.h>
+#endif
+
+/* Cached result of feature detection. */
+static int sha256_present = -1;
+
+/**
+ * cpusupport_arm_sha256(void):
+ * Return non-zero if the CPU supports the ARMv8 SHA256 instructions.
+ */
+int
+cpusupport_arm_sha256(void)
+{
+	unsigned long hwcap = 0;
+
+	/* Have we already checked? */
+	if (sha256_present != -1)
+		return (sha256_present);
+
+	/* Ask the kernel which instructions the CPU supports. */
+#if defined(__FreeBSD__)
+	if (elf_aux_info(AT_HWCAP, &hwcap, sizeof(hwcap)))
+		hwcap = 0;
+#elif defined(__linux__)
+	hwcap = getauxval(AT_HWCAP);
+#endif
+	sha256_present = (hwcap & HWCAP_SHA2) ? 1 : 0;
+
+	/* Return the cached value. */
+	return (sha256_present);
+}
+#endif /* CPUSUPPORT_ARM_SHA256 */
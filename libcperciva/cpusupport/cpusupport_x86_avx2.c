@@ -0,0 +1,53 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_X86_AVX2
+#include <cpuid.h>
+#include <stddef.h>
+
+#define CPUID_OSXSAVE_BIT (1 << 27)
+#define CPUID_AVX_BIT (1 << 28)
+#define CPUID_AVX2_BIT (1 << 5)
+
+/* XCR0 bits indicating that the OS saves the SSE and AVX registers. */
+#define XCR0_YMM (0x2 | 0x4)
+
+/* Cached result of feature detection. */
+static int avx2_present = -1;
+
+/**
+ * cpusupport_x86_avx2(void):
+ * Return non-zero if the CPU and operating system support AVX2.
+ */
+int
+cpusupport_x86_avx2(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	int present = 0;
+
+	/* Have we already checked? */
+	if (avx2_present != -1)
+		return (avx2_present);
+
+	/* Check for AVX and for the OS having enabled XGETBV. */
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		goto done;
+	if (((ecx & CPUID_OSXSAVE_BIT) == 0) || ((ecx & CPUID_AVX_BIT) == 0))
+		goto done;
+
+	/* Check that the OS saves the AVX registers on context switches. */
+	__asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	if ((eax & XCR0_YMM) != XCR0_YMM)
+		goto done;
+
+	/* Check for AVX2, which is in leaf 7. */
+	if (__get_cpuid_max(0, NULL) < 7)
+		goto done;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	present = (ebx & CPUID_AVX2_BIT) ? 1 : 0;
+
+done:
+	/* Cache and return the result. */
+	avx2_present = present;
+	return (avx2_present);
+}
+#endif /* CPUSUPPORT_X86_AVX2 */
@@ -0,0 +1,33 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_X86_CRC32_64
+#include <cpuid.h>
+
+#define CPUID_SSE42_BIT (1 << 20)
+
+/* Cached result of feature detection. */
+static int crc32_64_present = -1;
+
+/**
+ * cpusupport_x86_crc32_64(void):
+ * Return non-zero if the CPU supports the SSE4.2 CRC32 instruction.
+ */
+int
+cpusupport_x86_crc32_64(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	/* Have we already checked? */
+	if (crc32_64_present != -1)
+		return (crc32_64_present);
+
+	/* Check whether the CPU reports that SSE4.2 is available. */
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		crc32_64_present = 0;
+	else
+		crc32_64_present = (ecx & CPUID_SSE42_BIT) ? 1 : 0;
+
+	/* Return the cached value. */
+	return (crc32_64_present);
+}
+#endif /* CPUSUPPORT_X86_CRC32_64 */
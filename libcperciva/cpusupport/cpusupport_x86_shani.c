@@ -0,0 +1,46 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_X86_SHANI
+#include <cpuid.h>
+#include <stddef.h>
+
+#define CPUID_SSSE3_BIT (1 << 9)
+#define CPUID_SSE41_BIT (1 << 19)
+#define CPUID_SHANI_BIT (1 << 29)
+
+/* Cached result of feature detection. */
+static int shani_present = -1;
+
+/**
+ * cpusupport_x86_shani(void):
+ * Return non-zero if the CPU supports the SHA extensions, along with the
+ * SSSE3 and SSE4.1 instructions which are needed to make use of them.
+ */
+int
+cpusupport_x86_shani(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	int present = 0;
+
+	/* Have we already checked? */
+	if (shani_present != -1)
+		return (shani_present);
+
+	/* Check for SSSE3 and SSE4.1. */
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		goto done;
+	if (((ecx & CPUID_SSSE3_BIT) == 0) || ((ecx & CPUID_SSE41_BIT) == 0))
+		goto done;
+
+	/* Check for the SHA extensions, which are in leaf 7. */
+	if (__get_cpuid_max(0, NULL) < 7)
+		goto done;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	present = (ebx & CPUID_SHANI_BIT) ? 1 : 0;
+
+done:
+	/* Cache and return the result. */
+	shani_present = present;
+	return (shani_present);
+}
+#endif /* CPUSUPPORT_X86_SHANI */
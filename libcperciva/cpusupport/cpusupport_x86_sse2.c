@@ -0,0 +1,33 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_X86_SSE2
+#include <cpuid.h>
+
+#define CPUID_SSE2_BIT (1 << 26)
+
+/* Cached result of feature detection. */
+static int sse2_present = -1;
+
+/**
+ * cpusupport_x86_sse2(void):
+ * Return non-zero if the CPU supports SSE2.
+ */
+int
+cpusupport_x86_sse2(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	/* Have we already checked? */
+	if (sse2_present != -1)
+		return (sse2_present);
+
+	/* Check whether the CPU reports that SSE2 is available. */
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		sse2_present = 0;
+	else
+		sse2_present = (edx & CPUID_SSE2_BIT) ? 1 : 0;
+
+	/* Return the cached value. */
+	return (sse2_present);
+}
+#endif /* CPUSUPPORT_X86_SSE2 */
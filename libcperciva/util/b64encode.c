@@ -0,0 +1,44 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "b64encode.h"
+
+static const char b64chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * b64encode(in, out, len):
+ * Convert ${len} bytes from ${in} into RFC 4648 base64 encoding, writing
+ * the resulting ((${len} + 2) / 3) * 4 bytes to ${out}; and append a NUL
+ * byte.
+ */
+void
+b64encode(const uint8_t * in, char * out, size_t len)
+{
+	uint32_t t;
+	size_t n;
+	size_t i;
+
+	/* Convert 3 bytes at a time into 4 characters. */
+	while (len > 0) {
+		/* Read up to 3 bytes, padding with zeroes. */
+		n = (len < 3) ? len : 3;
+		for (t = 0, i = 0; i < 3; i++)
+			t = (t << 8) + ((i < n) ? in[i] : 0);
+
+		/* Write n + 1 characters, then pad with '=' up to 4. */
+		for (i = 0; i < 4; i++) {
+			if (i <= n)
+				*out++ = b64chars[(t >> (18 - 6 * i)) & 0x3f];
+			else
+				*out++ = '=';
+		}
+
+		/* Move on to the next bytes. */
+		in += n;
+		len -= n;
+	}
+
+	/* NUL-terminate. */
+	*out = '\0';
+}
@@ -0,0 +1,15 @@
+#ifndef _B64ENCODE_H_
+#define _B64ENCODE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * b64encode(in, out, len):
+ * Convert ${len} bytes from ${in} into RFC 4648 base64 encoding, writing
+ * the resulting ((${len} + 2) / 3) * 4 bytes to ${out}; and append a NUL
+ * byte.
+ */
+void b64encode(const uint8_t *, char *, size_t);
+
+#endif /* !_B64ENCODE_H_ */
@@ -1,26 +1,52 @@
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
+#include <aio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "asprintf.h"
 #include "aws_sign.h"
+#include "b64encode.h"
+#include "bqueue.h"
+#include "crc32c.h"
+#include "ec2_manifest.h"
 #include "elasticarray.h"
 #include "entropy.h"
+#include "hashindex.h"
 #include "hexify.h"
+#include "httpresp.h"
+#include "partjournal.h"
 #include "rfc3986.h"
+#include "sha256.h"
+#include "sha256_mb.h"
 #include "sslreq.h"
+#include "statefile.h"
 #include "warnp.h"
+#include "xzreader.h"
 
 #ifndef CERTFILE
 #define CERTFILE "/usr/local/share/certs/ca-root-nss.crt"
 #endif
 #define PARTSZ (10 * 1024 * 1024)
+#define MINPARTSZ (1024 * 1024)
+#define MAXPARTSZ (256 * 1024 * 1024)
+#define MAXPARTS 10000
+#define PROBESZ (4 * 1024 * 1024)
+#define PARTSECS 15
+#define READDEPTH 4
+#define DIRECTALIGN 4096
+#define MAXREADDEPTH 64
+#define STREAMCHUNK (64 * 1024)
 
 /* Elastic string type. */
 ELASTICARRAY_DECL(STR, str, char);
@@ -153,52 +179,72 @@ err0:
 	return (-1);
 }
 
+/* What getetag produces if there is no usable ETag. */
+static const uint8_t zeroetag[16];
+
+/* Set ${etag} to the ETag in ${resp}, or to zeroes if it isn't an MD5. */
+static void
+getetag(const struct httpresp * resp, uint8_t etag[16])
+{
+	const char * s;
+
+	/* S3 normally returns the hexified MD5 of the object, quoted. */
+	if ((s = httpresp_header(resp, "ETag")) != NULL) {
+		if (s[0] == '"')
+			s++;
+		if ((strlen(s) >= 32) && (unhexify(s, etag, 16) == 0))
+			return;
+	}
+
+	/* No usable ETag. */
+	memset(etag, 0, 16);
+}
+
 static int
 s3_put(const char * key_id, const char * key_secret, const char * region,
-    const char * bucket, const char * path, const uint8_t * buf, size_t buflen)
+    const char * bucket, const char * path, const uint8_t * buf, size_t buflen,
+    const char * content_sha256, const char * checksum_crc32c, uint8_t * etag)
 {
 	char * x_amz_content_sha256;
 	char * x_amz_date;
 	char * authorization;
 	char * host;
 	char * headers;
-	uint8_t * req;
+	struct iovec req[2];
 	const char * errstr;
-	uint8_t * resp;
-	size_t len;
-	size_t resplen;
-	size_t pos;
+	struct httpresp * resp;
+	const char * echoed;
 
-	/* Sign request. */
-	if (aws_sign_s3_headers(key_id, key_secret, region, "PUT", bucket,
-	    path, buf, buflen, &x_amz_content_sha256, &x_amz_date,
-	    &authorization)) {
+	/* Sign request; the caller has already hashed the body. */
+	if (aws_sign_s3_headers_prehashed(key_id, key_secret, region, "PUT",
+	    bucket, path, content_sha256, checksum_crc32c,
+	    &x_amz_content_sha256, &x_amz_date, &authorization)) {
 		warnp("Failed to sign PUT request");
 		goto err0;
 	}
 
-	/* Construct request header and compute length. */
+	/* Construct request header. */
 	if (asprintf(&headers,
 	    "PUT %s HTTP/1.1\r\n"
 	    "Host: %s.s3.amazonaws.com\r\n"
 	    "X-Amz-Date: %s\r\n"
 	    "X-Amz-Content-SHA256: %s\r\n"
+	    "%s%s%s"
 	    "Authorization: %s\r\n"
 	    "Content-Length: %zu\r\n"
-	    "Connection: close\r\n"
 	    "\r\n",
 	    path, bucket, x_amz_date, x_amz_content_sha256,
+	    checksum_crc32c ? "X-Amz-Checksum-CRC32C: " : "",
+	    checksum_crc32c ? checksum_crc32c : "",
+	    checksum_crc32c ? "\r\n" : "",
 	    authorization, buflen) == -1)
 		goto err1;
-	len = strlen(headers);
 
-	/* Append request body. */
-	if ((req = realloc(headers, len + buflen)) == NULL) {
-		free(headers);
-		goto err1;
-	}
-	memcpy(&req[len], buf, buflen);
-	len += buflen;
+	/* The request is the header followed by the body, sent in place. */
+	req[0].iov_base = headers;
+	req[0].iov_len = strlen(headers);
+	req[1].iov_base = (void *)(uintptr_t)buf;
+	req[1].iov_len = buflen;
 
 	/* Construct S3 endpoint name. */
 	if (strcmp(region, "us-east-1")) {
@@ -209,37 +255,38 @@ s3_put(const char * key_id, const char * key_secret, const char * region,
 			goto err2;
 	}
 
-	/* Allocate space for a 16 kB response plus a trailing NUL. */
-	resplen = 16384;
-	if ((resp = malloc(resplen + 1)) == NULL)
-		goto err3;
-
 	/* Send the request. */
-	if ((errstr = sslreq(host, "443", CERTFILE, req, len, resp, &resplen))
-	    != NULL) {
+	if ((errstr = sslreq(host, "443", req, 2, &resp)) != NULL) {
 		warnp("SSL request failed: %s", errstr);
-		goto err4;
+		goto err3;
 	}
 
-	/* NUL-terminate the response. */
-	resp[resplen] = '\0';
-
-        /* Find the end of the first line. */
-        pos = strcspn(resp, "\r\n");
+	/* Check for a "200" status. */
+	if (resp->status != 200) {
+		warnp("S3 request failed: HTTP status %d\n%s\n",
+		    resp->status, resp->body);
+		goto err4;
+	}
 
-        /* Look for a "200" status on the first line. */
-        if ((strstr(resp, " 200 ") == NULL) ||
-            (strstr(resp, " 200 ") > (char *)&resp[pos])) {
-		warnp("S3 request failed:\n%s\n", resp);
+	/* If S3 tells us what checksum it computed, make sure it matches. */
+	if ((checksum_crc32c != NULL) && ((echoed =
+	    httpresp_header(resp, "x-amz-checksum-crc32c")) != NULL) &&
+	    strcmp(echoed, checksum_crc32c)) {
+		warn0("S3 computed CRC32C %s, but we sent %s: %s",
+		    echoed, checksum_crc32c, path);
 		goto err4;
 	}
 
+	/* Return the ETag if requested. */
+	if (etag != NULL)
+		getetag(resp, etag);
+
 	/* Free response. */
-	free(resp);
+	httpresp_free(resp);
 
 	/* Free request buffers. */
 	free(host);
-	free(req);
+	free(headers);
 	free(authorization);
 	free(x_amz_date);
 	free(x_amz_content_sha256);
@@ -248,11 +295,11 @@ s3_put(const char * key_id, const char * key_secret, const char * region,
 	return (0);
 
 err4:
-	free(resp);
+	httpresp_free(resp);
 err3:
 	free(host);
 err2:
-	free(req);
+	free(headers);
 err1:
 	free(authorization);
 	free(x_amz_date);
@@ -264,217 +311,1645 @@ err0:
 
 static int
 s3_put_loop(const char * key_id, const char * key_secret, const char * region,
-    const char * bucket, const char * path, const uint8_t * buf, size_t buflen)
+    const char * bucket, const char * path, const uint8_t * buf, size_t buflen,
+    const char * content_sha256, const char * checksum_crc32c, uint8_t * etag)
 {
 	int i;
 
 	/* Try up to 10 times. */
 	for (i = 0; i < 10; i++) {
 		if (s3_put(key_id, key_secret, region, bucket, path,
-		    buf, buflen) == 0)
+		    buf, buflen, content_sha256, checksum_crc32c, etag) == 0)
 			return (0);
 		fprintf(stderr, "S3 PUT failed %d times: %s\n", i + 1, path);
 	}
 
-	/* Give up. */
-	return (-1);
+	/* Give up. */
+	return (-1);
+}
+
+/*
+ * Send a ${method} request without a body for ${path} in ${bucket}, and
+ * return the HTTP status code of the response, or -1 on error.  If ${etag}
+ * is not NULL, set it to the ETag in the response.
+ */
+static int
+s3_status(const char * key_id, const char * key_secret, const char * region,
+    const char * bucket, const char * method, const char * path,
+    uint8_t * etag)
+{
+	char * x_amz_content_sha256;
+	char * x_amz_date;
+	char * authorization;
+	char * host;
+	char * headers;
+	struct iovec req;
+	const char * errstr;
+	struct httpresp * resp;
+	int status;
+
+	/* Sign request. */
+	if (aws_sign_s3_headers(key_id, key_secret, region, method,
+	    bucket, path, NULL, 0, &x_amz_content_sha256, &x_amz_date,
+	    &authorization)) {
+		warnp("Failed to sign %s request", method);
+		goto err0;
+	}
+
+	/* Construct request. */
+	if (asprintf(&headers,
+	    "%s %s HTTP/1.1\r\n"
+	    "Host: %s.s3.amazonaws.com\r\n"
+	    "X-Amz-Date: %s\r\n"
+	    "X-Amz-Content-SHA256: %s\r\n"
+	    "Authorization: %s\r\n"
+	    "\r\n",
+	    method, path, bucket, x_amz_date, x_amz_content_sha256,
+	    authorization) == -1)
+		goto err1;
+	req.iov_base = headers;
+	req.iov_len = strlen(headers);
+
+	/* Construct S3 endpoint name. */
+	if (strcmp(region, "us-east-1")) {
+		if (asprintf(&host, "s3.%s.amazonaws.com", region) == -1)
+			goto err2;
+	} else {
+		if (asprintf(&host, "s3.amazonaws.com", region) == -1)
+			goto err2;
+	}
+
+	/* Send the request. */
+	if ((errstr = sslreq(host, "443", &req, 1, &resp)) != NULL) {
+		warnp("SSL request failed: %s", errstr);
+		goto err3;
+	}
+
+	/* We only care about the status, and perhaps the ETag. */
+	status = resp->status;
+	if (etag != NULL)
+		getetag(resp, etag);
+	httpresp_free(resp);
+
+	/* Free request buffers. */
+	free(host);
+	free(headers);
+	free(authorization);
+	free(x_amz_date);
+	free(x_amz_content_sha256);
+
+	/* Success! */
+	return (status);
+
+err3:
+	free(host);
+err2:
+	free(headers);
+err1:
+	free(authorization);
+	free(x_amz_date);
+	free(x_amz_content_sha256);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* A part of the disk image, and a buffer for holding it. */
+struct uploadpart {
+	uint64_t partnum;
+	uint8_t * buf;
+	size_t buflen;
+	char content_sha256[65];
+	uint8_t sha256[32];
+	char checksum_crc32c[9];
+	uint8_t etag[16];
+	struct aiocb cb;
+};
+
+/* State shared by part-reading, -hashing, and -uploading threads. */
+struct uploadstate {
+	const char * fname;
+	int fd;
+	off_t size;
+	uint64_t nparts;
+	int stream;			/* Size unknown until EOF. */
+	uint64_t maxparts;		/* Parts in zeroparts and hashes. */
+	const char * noncehex;
+	const char * region;
+	const char * bucket;
+	const char * key_id;
+	const char * key_secret;
+	int unsignedpayload;		/* Send CRC32C instead of SHA256. */
+	int chunked;			/* Read and sign parts as sent. */
+	size_t partsz;			/* Size of each part but the last. */
+	struct xzreader * X;		/* Decompressor, or NULL. */
+	uint8_t * map;			/* Image mapped into memory, or NULL. */
+	int dfd;			/* Image opened with O_DIRECT, or -1. */
+	int nocache;			/* Keep the image out of the cache. */
+	size_t readdepth;		/* Parts being read at once. */
+	struct partjournal * J;		/* Uploaded parts, or NULL. */
+	uint8_t * zeroparts;		/* Parts which are all zeroes. */
+	struct hashindex * H;		/* Hashes in S3, or NULL. */
+	uint8_t (* hashes)[32];		/* SHA256 of each part, if H. */
+	uint64_t nreused;		/* Parts already in S3. */
+	struct bqueue * freebufs;	/* Buffers available for reading. */
+	struct bqueue * tohash;		/* Parts waiting to be hashed. */
+	struct bqueue * tosend;		/* Parts waiting to be uploaded. */
+	int hashing;			/* Hashing threads still running. */
+	uint64_t nextcheck;		/* Next part to check is in S3. */
+	pthread_mutex_t mtx;
+	int failed;
+};
+
+/* Record that something went wrong, and make all of the threads stop. */
+static void
+uploadfail(struct uploadstate * U)
+{
+
+	/* Record the failure. */
+	pthread_mutex_lock(&U->mtx);
+	U->failed = 1;
+	pthread_mutex_unlock(&U->mtx);
+
+	/* Wake up anyone waiting on a queue. */
+	bqueue_close(U->freebufs);
+	bqueue_close(U->tohash);
+	bqueue_close(U->tosend);
+}
+
+static int
+readpart(int fd, uint8_t * buf, size_t buflen, off_t pos)
+{
+	ssize_t lenread;
+
+	/* Keep reading until we have the entire part. */
+	while (buflen > 0) {
+		if ((lenread = pread(fd, buf, buflen, pos)) == -1) {
+			if (errno == EINTR)
+				continue;
+			goto err0;
+		}
+
+		/* The file shouldn't shrink while we're reading it. */
+		if (lenread == 0) {
+			warn0("Unexpected EOF");
+			goto err0;
+		}
+
+		/* We've read a portion of the part. */
+		buf += (size_t)lenread;
+		buflen -= (size_t)lenread;
+		pos += lenread;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Read up to ${len} bytes into ${buf} from the pipe ${fd}, stopping short
+ * only at EOF.  Return the number of bytes read, or -1 on error.
+ */
+static ssize_t
+readfull(int fd, uint8_t * buf, size_t len)
+{
+	size_t pos = 0;
+	ssize_t lenread;
+
+	/* Keep reading until we have it all or there is no more. */
+	while (pos < len) {
+		if ((lenread = read(fd, &buf[pos], len - pos)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		if (lenread == 0)
+			break;
+		pos += (size_t)lenread;
+	}
+
+	/* Success! */
+	return ((ssize_t)pos);
+}
+
+/*
+ * Make room in the per-part arrays of ${U} for at least ${nparts} parts.
+ * This may only be called by the thread reading parts.
+ */
+static int
+growparts(struct uploadstate * U, uint64_t nparts)
+{
+	uint8_t * zeroparts;
+	uint8_t (* hashes)[32];
+	uint64_t maxparts;
+
+	/* Do we already have room? */
+	if (nparts <= U->maxparts)
+		return (0);
+
+	/* Double the size, to avoid copying too often. */
+	maxparts = U->maxparts * 2;
+	if (maxparts < nparts)
+		maxparts = nparts;
+
+	/* Only we touch the zero-part flags while parts are uploading. */
+	if ((zeroparts = realloc(U->zeroparts, maxparts + 1)) == NULL)
+		goto err0;
+	memset(&zeroparts[U->maxparts], 0, maxparts + 1 - U->maxparts);
+	U->zeroparts = zeroparts;
+
+	/* Hashes are recorded by the uploading threads, though. */
+	if (U->H != NULL) {
+		pthread_mutex_lock(&U->mtx);
+		hashes = realloc(U->hashes, (maxparts + 1) * 32);
+		if (hashes != NULL)
+			U->hashes = hashes;
+		pthread_mutex_unlock(&U->mtx);
+		if (hashes == NULL)
+			goto err0;
+	}
+	U->maxparts = maxparts;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Advise the kernel, via madvise(2) ${advice}, about how we are going to
+ * use the ${len} bytes at offset ${pos} in the memory-mapped image.
+ */
+static void
+mapadvise(struct uploadstate * U, off_t pos, size_t len, int advice)
+{
+	size_t off;
+
+	/* The advice has to start on a page boundary. */
+	off = (size_t)pos % (size_t)sysconf(_SC_PAGESIZE);
+
+	/* It's only advice, so we don't care if it fails. */
+	(void)madvise(&U->map[pos - (off_t)off], len + off, advice);
+}
+
+/*
+ * We're finished with the part ${P}; make sure that the part of the disk
+ * image which it came from isn't taking up memory.
+ */
+static void
+dropcache(struct uploadstate * U, struct uploadpart * P)
+{
+	off_t pos = (off_t)(P->partnum * U->partsz);
+
+	/* This is only advice, so we don't care if it fails. */
+	if (U->map != NULL)
+		mapadvise(U, pos, P->buflen, MADV_DONTNEED);
+	else if (U->nocache)
+		(void)posix_fadvise(U->fd, pos, (off_t)P->buflen,
+		    POSIX_FADV_DONTNEED);
+}
+
+/*
+ * Return the descriptor to use for reading ${len} bytes at offset ${pos}
+ * in the disk image: the O_DIRECT one if we have it and the read is
+ * suitably aligned, or the normal one otherwise.
+ */
+static int
+readfd(struct uploadstate * U, off_t pos, size_t len)
+{
+
+	if ((U->dfd != -1) && ((pos % DIRECTALIGN) == 0) &&
+	    ((len % DIRECTALIGN) == 0))
+		return (U->dfd);
+	else
+		return (U->fd);
+}
+
+/* Is the region [${pos}, ${pos} + ${len}) of ${fd} entirely in a hole? */
+static int
+inhole(int fd, off_t pos, size_t len)
+{
+#ifdef SEEK_DATA
+	off_t data;
+
+	/* Find the first data at or after ${pos}; ENXIO means there is none. */
+	if ((data = lseek(fd, pos, SEEK_DATA)) == -1)
+		return (errno == ENXIO);
+	return (data >= pos + (off_t)len);
+#else
+	(void)fd; /* UNUSED */
+	(void)pos; /* UNUSED */
+	(void)len; /* UNUSED */
+
+	/* We can't tell, so assume not. */
+	return (0);
+#endif
+}
+
+/* Is ${buf} entirely zeroes? */
+static int
+iszero(const uint8_t * buf, size_t len)
+{
+	uint64_t w, acc;
+	size_t i, j;
+
+	/*
+	 * OR together 4 kB at a time, which compilers vectorize; this lets us
+	 * stop soon after the first non-zero byte without testing every word.
+	 */
+	for (i = 0; i + 4096 <= len; i += 4096) {
+		for (acc = 0, j = i; j < i + 4096; j += sizeof(uint64_t)) {
+			memcpy(&w, &buf[j], sizeof(uint64_t));
+			acc |= w;
+		}
+		if (acc != 0)
+			return (0);
+	}
+
+	/* Check any leftover bytes. */
+	for (; i < len; i++) {
+		if (buf[i] != 0)
+			return (0);
+	}
+
+	/* It's all zeroes. */
+	return (1);
+}
+
+/* A part being read, signed, and sent in aws-chunked encoding. */
+struct chunkedbody {
+	struct aws_sign_chunked * S;
+	int fd;
+	off_t pos;
+	size_t len;
+	size_t done;
+	int finished;
+	uint8_t * buf;
+	char hdr[AWS_SIGN_CHUNKHDR_MAX];
+	struct iovec iov[3];
+};
+
+/* Read and sign the next chunk of the part ${cookie}; see sslreq_bodyfunc. */
+static int
+chunkedbody_next(void * cookie, int start, const struct iovec ** iov,
+    size_t * iovcnt)
+{
+	struct chunkedbody * B = cookie;
+	size_t len;
+
+	/* Go back to the beginning if asked. */
+	if (start) {
+		aws_sign_s3_chunked_rewind(B->S);
+		B->done = 0;
+		B->finished = 0;
+	}
+
+	/* Have we already sent the final empty chunk? */
+	if (B->finished) {
+		*iovcnt = 0;
+		return (0);
+	}
+
+	/* Read the next chunk; once we run out, send an empty chunk. */
+	len = B->len - B->done;
+	if (len > STREAMCHUNK)
+		len = STREAMCHUNK;
+	if (readpart(B->fd, B->buf, len, B->pos + (off_t)B->done)) {
+		warnp("Error reading disk image");
+		goto err0;
+	}
+	B->done += len;
+	if (len == 0)
+		B->finished = 1;
+
+	/* Sign the chunk, and send it with its header and trailing CRLF. */
+	aws_sign_s3_chunked(B->S, B->buf, len, B->hdr);
+	B->iov[0].iov_base = B->hdr;
+	B->iov[0].iov_len = strlen(B->hdr);
+	B->iov[1].iov_base = B->buf;
+	B->iov[1].iov_len = len;
+	B->iov[2].iov_base = (void *)(uintptr_t)"\r\n";
+	B->iov[2].iov_len = 2;
+	*iov = B->iov;
+	*iovcnt = 3;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+static int
+s3_put_chunked(const char * key_id, const char * key_secret,
+    const char * region, const char * bucket, const char * path, int fd,
+    off_t pos, size_t len, uint8_t * buf, uint8_t * etag)
+{
+	struct chunkedbody B;
+	char * x_amz_date;
+	char * authorization;
+	char * host;
+	char * headers;
+	struct iovec req;
+	const char * errstr;
+	struct httpresp * resp;
+
+	/* Sign request headers; the chunks are signed as they are sent. */
+	if ((B.S = aws_sign_s3_chunked_init(key_id, key_secret, region, "PUT",
+	    bucket, path, len, &x_amz_date, &authorization)) == NULL) {
+		warnp("Failed to sign PUT request");
+		goto err0;
+	}
+	B.fd = fd;
+	B.pos = pos;
+	B.len = len;
+	B.buf = buf;
+
+	/* Construct request header. */
+	if (asprintf(&headers,
+	    "PUT %s HTTP/1.1\r\n"
+	    "Host: %s.s3.amazonaws.com\r\n"
+	    "X-Amz-Date: %s\r\n"
+	    "X-Amz-Content-SHA256: STREAMING-AWS4-HMAC-SHA256-PAYLOAD\r\n"
+	    "X-Amz-Decoded-Content-Length: %zu\r\n"
+	    "Content-Encoding: aws-chunked\r\n"
+	    "Authorization: %s\r\n"
+	    "Content-Length: %" PRIu64 "\r\n"
+	    "\r\n",
+	    path, bucket, x_amz_date, len, authorization,
+	    aws_sign_s3_chunked_len(len, STREAMCHUNK)) == -1)
+		goto err1;
+	req.iov_base = headers;
+	req.iov_len = strlen(headers);
+
+	/* Construct S3 endpoint name. */
+	if (strcmp(region, "us-east-1")) {
+		if (asprintf(&host, "s3.%s.amazonaws.com", region) == -1)
+			goto err2;
+	} else {
+		if (asprintf(&host, "s3.amazonaws.com", region) == -1)
+			goto err2;
+	}
+
+	/* Send the request, reading the body as we go. */
+	if ((errstr = sslreq_stream(host, "443", &req, 1, chunkedbody_next,
+	    &B, &resp)) != NULL) {
+		warnp("SSL request failed: %s", errstr);
+		goto err3;
+	}
+
+	/* Check for a "200" status. */
+	if (resp->status != 200) {
+		warnp("S3 request failed: HTTP status %d\n%s\n",
+		    resp->status, resp->body);
+		goto err4;
+	}
+
+	/* Return the ETag if requested. */
+	if (etag != NULL)
+		getetag(resp, etag);
+
+	/* Free response. */
+	httpresp_free(resp);
+
+	/* Free request buffers and signing state. */
+	free(host);
+	free(headers);
+	free(authorization);
+	free(x_amz_date);
+	aws_sign_s3_chunked_free(B.S);
+
+	/* Success! */
+	return (0);
+
+err4:
+	httpresp_free(resp);
+err3:
+	free(host);
+err2:
+	free(headers);
+err1:
+	free(authorization);
+	free(x_amz_date);
+	aws_sign_s3_chunked_free(B.S);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+static int
+s3_put_chunked_loop(const char * key_id, const char * key_secret,
+    const char * region, const char * bucket, const char * path, int fd,
+    off_t pos, size_t len, uint8_t * buf, uint8_t * etag)
+{
+	int i;
+
+	/* Try up to 10 times. */
+	for (i = 0; i < 10; i++) {
+		if (s3_put_chunked(key_id, key_secret, region, bucket, path,
+		    fd, pos, len, buf, etag) == 0)
+			return (0);
+		fprintf(stderr, "S3 PUT failed %d times: %s\n", i + 1, path);
+	}
+
+	/* Give up. */
+	return (-1);
+}
+
+/*
+ * Start reading the part ${P} from offset ${pos} of the disk image, using
+ * asynchronous I/O if we can, or reading it right away if we can't.
+ */
+static int
+readstart(struct uploadstate * U, struct uploadpart * P, off_t pos)
+{
+
+	/* Ask for the part to be read. */
+	memset(&P->cb, 0, sizeof(struct aiocb));
+	P->cb.aio_fildes = readfd(U, pos, P->buflen);
+	P->cb.aio_offset = pos;
+	P->cb.aio_buf = P->buf;
+	P->cb.aio_nbytes = P->buflen;
+	P->cb.aio_sigevent.sigev_notify = SIGEV_NONE;
+	if (aio_read(&P->cb) == 0)
+		return (0);
+
+	/*
+	 * If the system can't do asynchronous I/O right now, read the part
+	 * the old way; a zero aio_nbytes tells readwait that we did.
+	 */
+	if ((errno != EAGAIN) && (errno != ENOSYS) && (errno != EOPNOTSUPP))
+		return (-1);
+	P->cb.aio_nbytes = 0;
+	return (readpart(P->cb.aio_fildes, P->buf, P->buflen, pos));
+}
+
+/* Wait for the read of the part ${P} started by readstart to finish. */
+static int
+readwait(struct uploadstate * U, struct uploadpart * P)
+{
+	const struct aiocb * cbs[1];
+	ssize_t lenread;
+	int rc;
+
+	/* Was it read already? */
+	if (P->cb.aio_nbytes == 0)
+		return (0);
+
+	/* Wait until it's done. */
+	cbs[0] = &P->cb;
+	while ((rc = aio_error(&P->cb)) == EINPROGRESS) {
+		if (aio_suspend(cbs, 1, NULL) &&
+		    (errno != EINTR) && (errno != EAGAIN))
+			goto err0;
+	}
+	lenread = aio_return(&P->cb);
+	if (rc != 0) {
+		if (rc != -1)
+			errno = rc;
+		goto err0;
+	}
+
+	/* If we got less than we asked for, read the rest ourselves. */
+	if (((size_t)lenread < P->buflen) && readpart(U->fd,
+	    &P->buf[lenread], P->buflen - (size_t)lenread,
+	    P->cb.aio_offset + lenread))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Finish with the part ${P} which has been read: if it was uploaded by an
+ * earlier run (${done} is non-zero) or is all zeroes, hand its buffer back;
+ * otherwise, pass it along to be hashed.  Return 0 on success, 1 if the
+ * upload has been stopped, or -1 on error.
+ */
+static int
+readdone(struct uploadstate * U, struct uploadpart * P, int done)
+{
+
+	/* Full-sized parts which are all zeroes share an object. */
+	if (!done && !U->chunked && (P->buflen == U->partsz) &&
+	    iszero(P->buf, P->buflen))
+		U->zeroparts[P->partnum] = 1;
+
+	/* Hand back buffers which we don't need to upload. */
+	if (done || U->zeroparts[P->partnum]) {
+		dropcache(U, P);
+		return (bqueue_put(U->freebufs, P));
+	}
+
+	/* Pass it along to be hashed. */
+	return (bqueue_put(U->tohash, P));
+}
+
+static void *
+readworker(void * cookie)
+{
+	struct uploadstate * U = cookie;
+	struct uploadpart * P;
+	struct uploadpart * inflight[MAXREADDEPTH];
+	size_t head = 0;
+	size_t ninflight = 0;
+	uint64_t partnum;
+	off_t pos;
+	size_t buflen;
+	ssize_t lenread;
+	int done;
+	int stopped = 0;
+	int rc;
+
+	/* Read parts in order; when streaming, until we reach EOF. */
+	for (partnum = 0; U->stream || (partnum < U->nparts); partnum++) {
+		/*
+		 * Skip parts which were uploaded by an earlier run; but a
+		 * compressed image has to be decompressed past them.
+		 */
+		done = (U->J != NULL) && partjournal_isdone(U->J, partnum);
+		if (done && (U->X == NULL))
+			continue;
+
+		/* Figure out where this part is; the last may be short. */
+		pos = (off_t)(partnum * U->partsz);
+		buflen = U->partsz;
+		if (!U->stream && (U->size - pos < (off_t)buflen))
+			buflen = U->size - pos;
+
+		/*
+		 * Full-sized parts which are all zeroes can share a single
+		 * uploaded object; parts in a hole are zero without reading.
+		 */
+		if ((U->X == NULL) && !U->stream && (buflen == U->partsz) &&
+		    inhole(U->fd, pos, buflen)) {
+			U->zeroparts[partnum] = 1;
+			continue;
+		}
+
+		/* If we have as many reads going as we allow, finish one. */
+		if (ninflight == U->readdepth) {
+			P = inflight[head];
+			head = (head + 1) % MAXREADDEPTH;
+			ninflight--;
+			if (readwait(U, P)) {
+				warnp("Error reading file: %s", U->fname);
+				goto err0;
+			}
+			if ((rc = readdone(U, P, 0)) == 1) {
+				stopped = 1;
+				break;
+			}
+			if (rc == -1)
+				goto err0;
+		}
+
+		/* Wait for a buffer; stop if something else went wrong. */
+		if ((rc = bqueue_get(U->freebufs, (void **)&P)) == 1) {
+			stopped = 1;
+			break;
+		}
+		if (rc == -1)
+			goto err0;
+		P->partnum = partnum;
+		P->buflen = buflen;
+
+		/*
+		 * Read part, unless it will be read as it is sent.  When
+		 * streaming, a short part is the last one, and we only know
+		 * how many parts there are once we get there.
+		 */
+		if (U->stream) {
+			if ((lenread = readfull(U->fd, P->buf,
+			    P->buflen)) == -1) {
+				warnp("Error reading file: %s", U->fname);
+				goto err0;
+			}
+			if (lenread == 0) {
+				if (bqueue_put(U->freebufs, P) == -1)
+					goto err0;
+				break;
+			}
+			if (partnum == MAXPARTS) {
+				warn0("Disk image has more than %d parts",
+				    MAXPARTS);
+				goto err0;
+			}
+			if (growparts(U, partnum + 1))
+				goto err0;
+			buflen = (size_t)lenread;
+			P->buflen = buflen;
+			U->size += lenread;
+			U->nparts = partnum + 1;
+		} else if (U->map != NULL) {
+			P->buf = &U->map[pos];
+			mapadvise(U, pos, P->buflen, MADV_WILLNEED);
+		} else if (U->X != NULL) {
+			if (xzreader_read(U->X, P->buf, P->buflen)) {
+				warnp("Error decompressing file: %s",
+				    U->fname);
+				goto err0;
+			}
+		} else if (U->readdepth > 1) {
+			if (readstart(U, P, pos)) {
+				warnp("Error reading file: %s", U->fname);
+				goto err0;
+			}
+			inflight[(head + ninflight) % MAXREADDEPTH] = P;
+			ninflight++;
+			continue;
+		} else if (!U->chunked &&
+		    readpart(readfd(U, pos, P->buflen), P->buf, P->buflen,
+		    pos)) {
+			warnp("Error reading file: %s", U->fname);
+			goto err0;
+		}
+
+		/* Hand it on. */
+		if ((rc = readdone(U, P, done)) == 1) {
+			stopped = 1;
+			break;
+		}
+		if (rc == -1)
+			goto err0;
+
+		/* A short part is the last one. */
+		if (buflen < U->partsz)
+			break;
+	}
+
+	/* Finish the reads which are still in progress. */
+	while (ninflight > 0) {
+		P = inflight[head];
+		head = (head + 1) % MAXREADDEPTH;
+		ninflight--;
+		if (readwait(U, P)) {
+			warnp("Error reading file: %s", U->fname);
+			goto err0;
+		}
+		if (!stopped && ((rc = readdone(U, P, 0)) != 0)) {
+			if (rc == -1)
+				goto err0;
+			stopped = 1;
+		}
+	}
+
+	/* No more parts are coming. */
+	bqueue_close(U->tohash);
+
+	/* Success! */
+	return (NULL);
+
+err0:
+	/* We can't give up buffers which are still being read into. */
+	while (ninflight > 0) {
+		P = inflight[head];
+		head = (head + 1) % MAXREADDEPTH;
+		ninflight--;
+		(void)readwait(U, P);
+	}
+
+	/* Tell the other threads to stop. */
+	uploadfail(U);
+
+	/* Failure! */
+	return (NULL);
+}
+
+static void *
+hashworker(void * cookie)
+{
+	struct uploadstate * U = cookie;
+	struct uploadpart * P[SHA256_MB_MAXLANES];
+	const uint8_t * bufs[SHA256_MB_MAXLANES];
+	size_t buflens[SHA256_MB_MAXLANES];
+	uint8_t hbufs[SHA256_MB_MAXLANES][32];
+	uint8_t cbuf[4];
+	size_t lanes = SHA256_mb_lanes();
+	size_t n, i;
+	int last;
+	int rc;
+
+	/* Hash parts until there are none left, several at once if we can. */
+	while ((rc = bqueue_getmany(U->tohash, (void **)P, lanes, &n)) == 0) {
+		/*
+		 * Compute the hexified SHA256 of each part; or if we're not
+		 * signing the payload, a base64-encoded CRC32C to protect it.
+		 * Parts sent in aws-chunked encoding are hashed as they are
+		 * sent instead.
+		 */
+		if (U->unsignedpayload) {
+			for (i = 0; i < n; i++) {
+				strcpy(P[i]->content_sha256,
+				    "UNSIGNED-PAYLOAD");
+				CRC32C_Buf(P[i]->buf, P[i]->buflen, cbuf);
+				b64encode(cbuf, P[i]->checksum_crc32c, 4);
+			}
+		} else if (!U->chunked) {
+			for (i = 0; i < n; i++) {
+				bufs[i] = P[i]->buf;
+				buflens[i] = P[i]->buflen;
+			}
+			SHA256_Buf_mb(bufs, buflens, hbufs, n);
+			for (i = 0; i < n; i++) {
+				hexify(hbufs[i], P[i]->content_sha256, 32);
+				memcpy(P[i]->sha256, hbufs[i], 32);
+			}
+		}
+
+		/* Pass them along to be uploaded. */
+		for (i = 0; i < n; i++) {
+			if ((rc = bqueue_put(U->tosend, P[i])) != 0)
+				break;
+		}
+		if (rc != 0)
+			break;
+	}
+	if (rc == -1)
+		goto err0;
+
+	/* If we're the last hashing thread, no more parts are coming. */
+	pthread_mutex_lock(&U->mtx);
+	last = (--U->hashing == 0);
+	pthread_mutex_unlock(&U->mtx);
+	if (last)
+		bqueue_close(U->tosend);
+
+	/* Success! */
+	return (NULL);
+
+err0:
+	/* Tell the other threads to stop. */
+	uploadfail(U);
+
+	/* Failure! */
+	return (NULL);
+}
+
+static void *
+uploadworker(void * cookie)
+{
+	struct uploadstate * U = cookie;
+	struct uploadpart * P;
+	char * path;
+	int failed;
+	int rc;
+
+	/* Upload parts until there are none left. */
+	while ((rc = bqueue_get(U->tosend, (void **)&P)) == 0) {
+		/* Don't bother with the rest if something went wrong. */
+		pthread_mutex_lock(&U->mtx);
+		failed = U->failed;
+		pthread_mutex_unlock(&U->mtx);
+		if (failed)
+			break;
+
+		/*
+		 * Generate part path; or if we store parts by content, see
+		 * if this one is already there.
+		 */
+		if (U->H != NULL) {
+			/* The hash array may be enlarged by readworker. */
+			pthread_mutex_lock(&U->mtx);
+			memcpy(U->hashes[P->partnum], P->sha256, 32);
+			pthread_mutex_unlock(&U->mtx);
+			if (asprintf(&path, "/sha256/%s",
+			    P->content_sha256) == -1)
+				goto err0;
+			if (hashindex_has(U->H, P->sha256) &&
+			    (s3_status(U->key_id, U->key_secret, U->region,
+			    U->bucket, "HEAD", path, NULL) == 200)) {
+				pthread_mutex_lock(&U->mtx);
+				U->nreused++;
+				pthread_mutex_unlock(&U->mtx);
+				goto done;
+			}
+		} else if (asprintf(&path, "/%s/part%" PRIu64, U->noncehex,
+		    P->partnum) == -1)
+			goto err0;
+
+		/* Upload to S3. */
+		if (U->chunked) {
+			if (s3_put_chunked_loop(U->key_id, U->key_secret,
+			    U->region, U->bucket, path, U->fd,
+			    (off_t)(P->partnum * U->partsz), P->buflen, P->buf,
+			    P->etag)) {
+				warnp("PUT failed");
+				goto err1;
+			}
+		} else {
+			if (s3_put_loop(U->key_id, U->key_secret, U->region,
+			    U->bucket, path, P->buf, P->buflen,
+			    P->content_sha256,
+			    U->unsignedpayload ? P->checksum_crc32c : NULL,
+			    P->etag)) {
+				warnp("PUT failed");
+				goto err1;
+			}
+		}
+
+		/* Record that this part doesn't need to be uploaded again. */
+		if ((U->J != NULL) &&
+		    partjournal_done(U->J, P->partnum, P->etag))
+			goto err1;
+		if ((U->H != NULL) && hashindex_add(U->H, P->sha256))
+			goto err1;
+
+done:
+		/* Free string allocated by asprintf. */
+		free(path);
+
+		/* Print one dot per part. */
+		fprintf(stderr, ".");
+
+		/* We won't look at this part of the disk image again. */
+		dropcache(U, P);
+
+		/* Hand the buffer back to be read into again. */
+		if ((rc = bqueue_put(U->freebufs, P)) != 0)
+			break;
+	}
+	if (rc == -1)
+		goto err0;
+
+	/* Success! */
+	return (NULL);
+
+err1:
+	free(path);
+err0:
+	/* Tell the other threads to stop. */
+	uploadfail(U);
+
+	/* Failure! */
+	return (NULL);
+}
+
+static void *
+checkworker(void * cookie)
+{
+	struct uploadstate * U = cookie;
+	uint64_t partnum;
+	uint8_t etag[16];
+	uint8_t s3etag[16];
+	char * path;
+	int status;
+	int changed;
+
+	/* Check parts until there are none left or something goes wrong. */
+	do {
+		pthread_mutex_lock(&U->mtx);
+		partnum = U->nextcheck++;
+		if (U->failed)
+			partnum = U->nparts;
+		pthread_mutex_unlock(&U->mtx);
+		if (partnum >= U->nparts)
+			break;
+
+		/* Only parts which an earlier run uploaded need checking. */
+		if (!partjournal_isdone(U->J, partnum))
+			continue;
+		if (partjournal_etag(U->J, partnum, etag))
+			goto err0;
+
+		/* Ask S3 for the part's ETag. */
+		if (asprintf(&path, "/%s/part%" PRIu64, U->noncehex,
+		    partnum) == -1)
+			goto err0;
+		status = s3_status(U->key_id, U->key_secret, U->region,
+		    U->bucket, "HEAD", path, s3etag);
+		free(path);
+		if ((status != 200) && (status != 404)) {
+			if (status != -1)
+				warn0("S3 HEAD failed: HTTP status %d",
+				    status);
+			goto err0;
+		}
+
+		/*
+		 * If the part is missing or has changed, upload it again.
+		 * We can only compare ETags which were MD5s both times.
+		 */
+		changed = memcmp(etag, zeroetag, 16) &&
+		    memcmp(s3etag, zeroetag, 16) && memcmp(etag, s3etag, 16);
+		if (((status == 404) || changed) &&
+		    partjournal_undone(U->J, partnum))
+			goto err0;
+	} while (1);
+
+	/* Success! */
+	return (NULL);
+
+err0:
+	/* Tell the other threads to stop. */
+	pthread_mutex_lock(&U->mtx);
+	U->failed = 1;
+	pthread_mutex_unlock(&U->mtx);
+
+	/* Failure! */
+	return (NULL);
+}
+
+/*
+ * Check, using ${jobs} threads, that the parts which the journal says were
+ * uploaded by an earlier run are still in S3 and unchanged; any which
+ * aren't are marked in the journal as needing to be uploaded again.
+ */
+static int
+checkparts(struct uploadstate * U, int jobs)
+{
+	pthread_t * thr;
+	int nthr;
+	int rc;
+
+	/* Allocate space for thread IDs. */
+	if ((thr = malloc((size_t)jobs * sizeof(pthread_t))) == NULL)
+		goto err0;
+
+	/* Launch checking threads. */
+	U->nextcheck = 0;
+	for (nthr = 0; nthr < jobs; nthr++) {
+		if ((rc = pthread_create(&thr[nthr], NULL, checkworker,
+		    U)) != 0) {
+			warn0("pthread_create: %s", strerror(rc));
+			pthread_mutex_lock(&U->mtx);
+			U->failed = 1;
+			pthread_mutex_unlock(&U->mtx);
+			break;
+		}
+	}
+
+	/* Wait for the threads to finish. */
+	while (nthr > 0) {
+		if ((rc = pthread_join(thr[--nthr], NULL)) != 0) {
+			warn0("pthread_join: %s", strerror(rc));
+			goto err1;
+		}
+	}
+
+	/* Free thread IDs. */
+	free(thr);
+
+	/* Did anything go wrong? */
+	return (U->failed ? -1 : 0);
+
+err1:
+	free(thr);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+static int
+uploadparts(struct uploadstate * U, int jobs)
+{
+	struct uploadpart * parts;
+	void * buf;
+	size_t nbufs;
+	size_t lanes;
+	size_t i;
+	pthread_t * thr;
+	long ncpus;
+	int nhash;
+	int nthr;
+	int rc;
+
+	/* Hash on as many threads as we upload on, but one per CPU at most. */
+	nhash = jobs;
+	if (((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) > 0) && (ncpus < nhash))
+		nhash = (int)ncpus;
+
+	/*
+	 * We need a buffer for each part being uploaded and one for each
+	 * part being read, plus one more so that reading can get ahead.  The
+	 * hashing threads share whatever parts are waiting, so they need
+	 * enough between them for one to hash a full set of lanes, or for
+	 * each of them to hash one part, but no more.  We never need more
+	 * than one buffer per part, though, if we know how many parts there
+	 * are.  Parts sent in aws-chunked encoding are read as they are
+	 * sent, so their buffers only need to hold one chunk; and
+	 * memory-mapped parts don't need buffers of their own, but we still
+	 * limit how many are in flight.
+	 */
+	lanes = (U->unsignedpayload || U->chunked) ? 1 : SHA256_mb_lanes();
+	nbufs = (size_t)jobs + 1 + U->readdepth +
+	    ((lanes > (size_t)nhash) ? lanes : (size_t)nhash);
+	if (!U->stream && ((uint64_t)nbufs > U->nparts))
+		nbufs = (U->nparts > 0) ? (size_t)U->nparts : 1;
+
+	/* Allocate part buffers, aligned so they can be used with O_DIRECT. */
+	if ((parts = malloc(nbufs * sizeof(struct uploadpart))) == NULL)
+		goto err0;
+	for (i = 0; i < nbufs; i++) {
+		if (U->map != NULL) {
+			parts[i].buf = NULL;
+			continue;
+		}
+		if ((rc = posix_memalign(&buf, DIRECTALIGN,
+		    U->chunked ? STREAMCHUNK : U->partsz)) != 0) {
+			errno = rc;
+			while (i > 0)
+				free(parts[--i].buf);
+			goto err1;
+		}
+		parts[i].buf = buf;
+	}
+
+	/* Create queues which can hold all of the buffers. */
+	if ((U->freebufs = bqueue_init(nbufs)) == NULL)
+		goto err2;
+	if ((U->tohash = bqueue_init(nbufs)) == NULL)
+		goto err3;
+	if ((U->tosend = bqueue_init(nbufs)) == NULL)
+		goto err4;
+
+	/* All of the buffers are available for reading. */
+	for (i = 0; i < nbufs; i++) {
+		if (bqueue_put(U->freebufs, &parts[i]))
+			goto err5;
+	}
+
+	/* Allocate space for thread IDs. */
+	if ((thr = malloc(((size_t)jobs + (size_t)nhash + 1) *
+	    sizeof(pthread_t))) == NULL)
+		goto err5;
+
+	/* Launch reading, hashing, and uploading threads. */
+	U->hashing = nhash;
+	for (nthr = 0; nthr < jobs + nhash + 1; nthr++) {
+		if ((rc = pthread_create(&thr[nthr], NULL,
+		    (nthr == 0) ? readworker :
+		    (nthr <= nhash) ? hashworker : uploadworker, U)) != 0) {
+			warn0("pthread_create: %s", strerror(rc));
+			uploadfail(U);
+			break;
+		}
+	}
+
+	/* Wait for the threads to finish. */
+	while (nthr > 0) {
+		if ((rc = pthread_join(thr[--nthr], NULL)) != 0) {
+			warn0("pthread_join: %s", strerror(rc));
+			goto err6;
+		}
+	}
+
+	/* Free thread IDs, queues, and buffers. */
+	free(thr);
+	bqueue_free(U->tosend);
+	bqueue_free(U->tohash);
+	bqueue_free(U->freebufs);
+	for (i = 0; (U->map == NULL) && (i < nbufs); i++)
+		free(parts[i].buf);
+	free(parts);
+
+	/* Did anything go wrong? */
+	return (U->failed ? -1 : 0);
+
+err6:
+	free(thr);
+
+	/* We can't safely free anything which other threads might touch. */
+	return (-1);
+
+err5:
+	bqueue_free(U->tosend);
+err4:
+	bqueue_free(U->tohash);
+err3:
+	bqueue_free(U->freebufs);
+err2:
+	for (i = 0; (U->map == NULL) && (i < nbufs); i++)
+		free(parts[i].buf);
+err1:
+	free(parts);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Upload the all-zero object which parts of zeroes share. */
+static int
+uploadzeropart(struct uploadstate * U)
+{
+	uint8_t * buf;
+	uint8_t hbuf[32];
+	char content_sha256[65];
+	char * path;
+	uint64_t i;
+
+	/* Construct and hash a part of zeroes. */
+	if ((buf = calloc(1, U->partsz)) == NULL)
+		goto err0;
+	SHA256_Buf(buf, U->partsz, hbuf);
+	hexify(hbuf, content_sha256, 32);
+
+	/*
+	 * If we store parts by content, the zero parts refer to it by its
+	 * hash, and we may have uploaded it already.
+	 */
+	if (U->H != NULL) {
+		for (i = 0; i < U->nparts; i++) {
+			if (U->zeroparts[i])
+				memcpy(U->hashes[i], hbuf, 32);
+		}
+		if (asprintf(&path, "/sha256/%s", content_sha256) == -1)
+			goto err1;
+		if (hashindex_has(U->H, hbuf) && (s3_status(U->key_id,
+		    U->key_secret, U->region, U->bucket, "HEAD", path,
+		    NULL) == 200))
+			goto done;
+	} else if (asprintf(&path, "/%s/zero", U->noncehex) == -1)
+		goto err1;
+
+	/* Upload it. */
+	if (s3_put_loop(U->key_id, U->key_secret, U->region, U->bucket, path,
+	    buf, U->partsz, content_sha256, NULL, NULL)) {
+		warnp("PUT failed");
+		goto err2;
+	}
+	if ((U->H != NULL) && hashindex_add(U->H, hbuf))
+		goto err2;
+
+done:
+	/* Clean up. */
+	free(path);
+	free(buf);
+
+	/* Success! */
+	return (0);
+
+err2:
+	free(path);
+err1:
+	free(buf);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Pick a part size for uploading a ${size}-byte disk image, or one of
+ * unknown size if ${size} is 0: time the upload of a probe object, and aim
+ * for parts which take PARTSECS seconds each to upload at that rate, within
+ * limits.  Return 0 on error.
+ */
+static uint64_t
+autopartsz(uint64_t size, const char * noncehex,
+    const char * key_id, const char * key_secret, const char * region,
+    const char * bucket)
+{
+	uint8_t * buf;
+	uint8_t hbuf[32];
+	char content_sha256[65];
+	char * path;
+	struct timespec t0, t1;
+	double secs;
+	uint64_t minsz;
+	uint64_t partsz;
+
+	/* The importer can't handle too many parts. */
+	minsz = (size + MAXPARTS - 1) / MAXPARTS;
+	if (minsz < MINPARTSZ)
+		minsz = MINPARTSZ;
+	if (minsz > MAXPARTSZ) {
+		warn0("Disk image is too large");
+		goto err0;
+	}
+
+	/* Don't bother measuring for images which fit in a default part. */
+	if ((size > 0) && (size <= PARTSZ))
+		return (PARTSZ);
+
+	/* S3 doesn't compress, so the probe can be all zeroes. */
+	if ((buf = calloc(1, PROBESZ)) == NULL)
+		goto err0;
+	SHA256_Buf(buf, PROBESZ, hbuf);
+	hexify(hbuf, content_sha256, 32);
+
+	/* Time the upload of the probe. */
+	fprintf(stderr, "Measuring upload speed...");
+	if (asprintf(&path, "/%s/probe", noncehex) == -1)
+		goto err1;
+	if (clock_gettime(CLOCK_MONOTONIC, &t0)) {
+		warnp("clock_gettime");
+		goto err2;
+	}
+	if (s3_put_loop(key_id, key_secret, region, bucket, path,
+	    buf, PROBESZ, content_sha256, NULL, NULL)) {
+		warnp("PUT failed");
+		goto err2;
+	}
+	if (clock_gettime(CLOCK_MONOTONIC, &t1)) {
+		warnp("clock_gettime");
+		goto err2;
+	}
+
+	/* Delete the probe; if we can't, it only wastes a little space. */
+	(void)s3_status(key_id, key_secret, region, bucket, "DELETE", path,
+	    NULL);
+
+	/* Scale the probe up to PARTSECS worth of uploading. */
+	secs = (double)(t1.tv_sec - t0.tv_sec) +
+	    (double)(t1.tv_nsec - t0.tv_nsec) / 1000000000.0;
+	if (secs < 0.001)
+		secs = 0.001;
+	if ((double)PROBESZ / secs * PARTSECS > (double)MAXPARTSZ)
+		partsz = MAXPARTSZ;
+	else
+		partsz = (uint64_t)((double)PROBESZ / secs * PARTSECS);
+
+	/* Round down to a whole number of MB, within limits. */
+	partsz -= partsz % MINPARTSZ;
+	if (partsz < minsz)
+		partsz = minsz;
+	fprintf(stderr, " using %" PRIu64 "-byte parts.\n", partsz);
+
+	/* Clean up. */
+	free(path);
+	free(buf);
+
+	/* Success! */
+	return (partsz);
+
+err2:
+	free(path);
+err1:
+	free(buf);
+err0:
+	/* Failure! */
+	return (0);
 }
 
 static char *
 uploadvolume(const char * fname, const char * region, const char * bucket,
-    uint64_t * size, const char * key_id, const char * key_secret)
+    uint64_t * size, const char * key_id, const char * key_secret, int jobs,
+    int unsignedpayload, int chunked, uint64_t partsz, int readdepth,
+    int direct, const char * journal, const char * dedup)
 {
-	FILE * f;
+	struct uploadstate U;
 	struct stat sb;
 	uint8_t nonce[16];
 	char noncehex[33];
-	uint8_t * buf;
-	size_t buflen = PARTSZ;
-	off_t pos;
+	uint8_t hbuf[32];
+	char content_sha256[65];
+	int rc;
 	char * path;
-	STR manifest;
 	char * s;
-	char * query;
+	struct aws_sign_presign * P;
 	size_t len;
+	uint64_t nzero;
+	uint64_t i;
+	uint64_t xzsize;
 
 	/* Get a random value to use as a nonce in our paths. */
 	if (entropy_read(nonce, 16)) {
 		warnp("Cannot generate nonce");
 		goto err0;
 	}
-	hexify(nonce, noncehex, 16);
 
-	/* Open the disk image and determine its length. */
-	if ((f = fopen(fname, "r")) == NULL) {
+	/* Open the disk image ("-" is stdin) and determine its length. */
+	if (strcmp(fname, "-") == 0)
+		U.fd = dup(STDIN_FILENO);
+	else
+		U.fd = open(fname, O_RDONLY);
+	if (U.fd == -1) {
 		warnp("Cannot open disk image: %s", fname);
 		goto err0;
 	}
-	if (fstat(fileno(f), &sb)) {
+	U.X = NULL;
+	U.map = NULL;
+	U.dfd = -1;
+	if (fstat(U.fd, &sb)) {
 		warnp("Cannot stat: %s", fname);
 		goto err1;
 	}
 
-	/* Allocate a buffer for holding a part. */
-	if ((buf = malloc(buflen)) == NULL)
-		goto err1;
-
-	/* Create an elastic string for the manifest. */
-	if ((manifest = str_init(0)) == NULL)
-		goto err2;
-
-	/* Generate manifest "self-destruct" query string. */
-	if (asprintf(&path, "/%s/manifest.xml", noncehex) == -1)
-		goto err3;
-	if ((query = aws_sign_s3_querystr(key_id, key_secret, region, "DELETE",
-	    bucket, path, 604800)) == NULL) {
-		warnp("Error generating presigned URL");
-		goto err4;
+	/* Disk devices don't report their size via fstat. */
+	if (S_ISCHR(sb.st_mode) || S_ISBLK(sb.st_mode)) {
+		if ((sb.st_size = lseek(U.fd, 0, SEEK_END)) == -1) {
+			warnp("Cannot determine size of %s", fname);
+			goto err1;
+		}
 	}
-	if ((query = encodeamp(query)) == NULL)
-		goto err4;
 
-	/* Construct the start of the manifest file. */
-	if (asprintf(&s,
-	    "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>"
-	    "<manifest>"
-		"<version>2010-11-15</version>"
-		"<file-format>RAW</file-format>"
-		"<importer>"
-		    "<name>bsdec2-image-upload</name>"
-		    "<version>1.2.2</version>"
-		    "<release>2019-03-20</release>"
-		"</importer>"
-		"<self-destruct-url>https://%s.s3.amazonaws.com%s?%s</self-destruct-url>"
-		"<import>"
-		    "<size>%" PRId64 "</size>"
-		    "<volume-size>%d</volume-size>"
-		    "<parts count=\"%" PRId64 "\">",
-	    bucket, path, query, (uint64_t)sb.st_size,
-	    (int)((sb.st_size + (1 << 30) - 1) / (1 << 30)),
-	    (uint64_t)(sb.st_size + PARTSZ - 1) / PARTSZ) == -1)
-		goto err5;
-	if (str_append(manifest, s, strlen(s)))
-		goto err6;
-	free(s);
-	free(query);
-	free(path);
+	/*
+	 * We don't know how big an image arriving through a pipe is until
+	 * we reach EOF, and we can't go back to read it again.
+	 */
+	U.stream = S_ISFIFO(sb.st_mode) || S_ISSOCK(sb.st_mode);
+	if (U.stream) {
+		if (chunked || (journal != NULL)) {
+			warn0("Disk images read from a pipe cannot be"
+			    " uploaded with --chunked or --journal");
+			goto err1;
+		}
+		sb.st_size = 0;
+	}
 
-	/* Say what we're doing. */
-	fprintf(stderr, "Uploading %s to\nhttp://%s.s3.amazonaws.com/%s/\n"
-	    "in %" PRId64 " part(s)", fname, bucket, noncehex,
-	    (uint64_t)(sb.st_size + PARTSZ - 1) / PARTSZ);
+	/*
+	 * An xz-compressed image is decompressed as it is read, and from
+	 * here on its size is the decompressed size.
+	 */
+	if (U.stream)
+		rc = 0;
+	else if ((rc = xzreader_isxz(U.fd)) == -1) {
+		warnp("Cannot read disk image: %s", fname);
+		goto err1;
+	}
+	if (rc) {
+		if (chunked) {
+			warn0("Compressed disk images cannot be uploaded"
+			    " using aws-chunked encoding");
+			goto err1;
+		}
+		if ((U.X = xzreader_open(U.fd, &xzsize)) == NULL) {
+			warnp("Cannot decompress disk image: %s", fname);
+			goto err1;
+		}
+		if (xzsize > INT64_MAX) {
+			warn0("Disk image is too large");
+			goto err1;
+		}
+		sb.st_size = (off_t)xzsize;
+	}
 
-	/* Upload parts one by one. */
-	for (pos = 0; pos < sb.st_size; pos += buflen) {
-		/* Print one dot per part. */
-		fprintf(stderr, ".");
+	/*
+	 * If we've been asked to keep the disk image out of the page cache,
+	 * read it with O_DIRECT if we can; we need the normal descriptor
+	 * too, for reads which aren't suitably aligned.  Either way, tell
+	 * the kernel that we won't read anything twice.
+	 */
+	U.nocache = direct && !U.stream;
+	if (U.nocache) {
+#ifdef O_DIRECT
+		if ((U.X == NULL) && strcmp(fname, "-"))
+			U.dfd = open(fname, O_RDONLY | O_DIRECT);
+#endif
+		if (U.dfd == -1)
+			fprintf(stderr, "O_DIRECT is not available for %s;"
+			    " using posix_fadvise instead.\n", fname);
+		(void)posix_fadvise(U.fd, 0, 0, POSIX_FADV_NOREUSE);
+	}
 
-		/* Shorter part if we're going to hit EOF. */
-		if (sb.st_size - pos < (off_t)buflen)
-			buflen = sb.st_size - pos;
+	/*
+	 * Otherwise, if we can, map the image into memory so that parts are
+	 * hashed and sent straight from the page cache; if not, we'll read
+	 * them.  Parts sent in aws-chunked encoding are read as they are
+	 * sent.
+	 */
+	if (!U.nocache && !U.stream && (U.X == NULL) && !chunked &&
+	    (sb.st_size > 0) && ((uintmax_t)sb.st_size <= SIZE_MAX)) {
+		U.map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED,
+		    U.fd, 0);
+		if (U.map == MAP_FAILED)
+			U.map = NULL;
+		else
+			(void)madvise(U.map, (size_t)sb.st_size,
+			    MADV_SEQUENTIAL);
+	}
 
-		/* Read part. */
-		if (fread(buf, buflen, 1, f) != 1) {
-			warnp("Error reading file: %s", fname);
-			goto err3;
-		}
+	/*
+	 * If we're reading parts with pread, keep several reads going at
+	 * once so that the disk can keep up with the uploads.
+	 */
+	if (!U.stream && (U.X == NULL) && (U.map == NULL) && !chunked)
+		U.readdepth = (size_t)readdepth;
+	else
+		U.readdepth = 1;
 
-		/* Generate part path. */
-		if (asprintf(&path, "/%s/part%" PRIu64, noncehex,
-		    (uint64_t)(pos / PARTSZ)) == -1)
-			goto err3;
+	/*
+	 * If we're picking the part size, carry on with the part size of an
+	 * interrupted upload; or failing that, measure the upload speed.
+	 */
+	hexify(nonce, noncehex, 16);
+	if ((partsz == 0) && (journal != NULL) &&
+	    partjournal_partsz(journal, &partsz))
+		goto err1;
+	if ((partsz == 0) && ((partsz = autopartsz((uint64_t)sb.st_size,
+	    noncehex, key_id, key_secret, region, bucket)) == 0))
+		goto err1;
+	if (((uint64_t)sb.st_size + partsz - 1) / partsz > MAXPARTS) {
+		warn0("Disk image would have more than %d parts", MAXPARTS);
+		goto err1;
+	}
 
-		/* Upload to S3. */
-		if (s3_put_loop(key_id, key_secret, region, bucket, path,
-		    buf, buflen)) {
-			warnp("PUT failed");
-			goto err4;
-		}
+	/* Open the journal, which may tell us to reuse an earlier nonce. */
+	U.J = NULL;
+	if ((journal != NULL) && ((U.J = partjournal_open(journal, &sb, partsz,
+	    region, bucket, nonce)) == NULL))
+		goto err1;
+	hexify(nonce, noncehex, 16);
 
-		/* Construct the start of the <part> block. */
-		if (asprintf(&s,
-		    "<part index=\"%" PRId64 "\">"
-			"<byte-range start=\"%" PRId64 "\" end=\"%" PRId64 "\"/>"
-			"<key>%s/part%" PRIu64 "</key>",
-		    (uint64_t)(pos / PARTSZ), pos, pos + buflen - 1, noncehex,
-		    (uint64_t)(pos / PARTSZ)) == -1)
-			goto err4;
-		if (str_append(manifest, s, strlen(s))) {
-			free(s);
-			goto err4;
-		}
+	/* Fill in the rest of the upload state. */
+	U.fname = fname;
+	U.size = sb.st_size;
+	U.partsz = (size_t)partsz;
+	U.nparts = ((uint64_t)sb.st_size + partsz - 1) / partsz;
+	U.maxparts = U.nparts;
+	U.noncehex = noncehex;
+	U.region = region;
+	U.bucket = bucket;
+	U.key_id = key_id;
+	U.key_secret = key_secret;
+	U.unsignedpayload = unsignedpayload;
+	U.chunked = chunked;
+	U.nreused = 0;
+	U.failed = 0;
+	if ((rc = pthread_mutex_init(&U.mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err2;
+	}
 
-		/* Generate <head-url> block. */
-		if ((query = aws_sign_s3_querystr(key_id, key_secret, region,
-		    "HEAD", bucket, path, 604800)) == NULL) {
-			warnp("Error generating presigned URL");
-			goto err4;
-		}
-		if ((query = encodeamp(query)) == NULL)
-			goto err4;
-		if (asprintf(&s,
-		    "<head-url>https://%s.s3.amazonaws.com%s?%s</head-url>",
-		    bucket, path, query) == -1)
-			goto err5;
-		if (str_append(manifest, s, strlen(s)))
-			goto err6;
-		free(s);
-		free(query);
+	/* No parts are known to be all zeroes yet. */
+	if ((U.zeroparts = calloc(U.nparts + 1, 1)) == NULL)
+		goto err3;
 
-		/* Generate <get-url> block. */
-		if ((query = aws_sign_s3_querystr(key_id, key_secret, region,
-		    "GET", bucket, path, 604800)) == NULL) {
-			warnp("Error generating presigned URL");
+	/* If we're storing parts by content, load the index of them. */
+	U.H = NULL;
+	U.hashes = NULL;
+	if (dedup != NULL) {
+		if ((U.H = hashindex_open(dedup)) == NULL) {
+			warnp("Cannot open part index: %s", dedup);
 			goto err4;
 		}
-		if ((query = encodeamp(query)) == NULL)
-			goto err4;
-		if (asprintf(&s,
-		    "<get-url>https://%s.s3.amazonaws.com%s?%s</get-url>",
-		    bucket, path, query) == -1)
+		if ((U.hashes = calloc(U.nparts + 1, 32)) == NULL)
 			goto err5;
-		if (str_append(manifest, s, strlen(s)))
-			goto err6;
-		free(s);
-		free(query);
+	}
 
-		/* Generate <delete-url> block. */
-		if ((query = aws_sign_s3_querystr(key_id, key_secret, region,
-		    "DELETE", bucket, path, 604800)) == NULL) {
-			warnp("Error generating presigned URL");
-			goto err4;
-		}
-		if ((query = encodeamp(query)) == NULL)
-			goto err4;
-		if (asprintf(&s,
-		    "<delete-url>https://%s.s3.amazonaws.com%s?%s</delete-url>",
-		    bucket, path, query) == -1)
-			goto err5;
-		if (str_append(manifest, s, strlen(s)))
-			goto err6;
-		free(s);
-		free(query);
+	/* Make sure the parts which an earlier run uploaded are still there. */
+	if ((U.J != NULL) && (partjournal_ndone(U.J) > 0) &&
+	    checkparts(&U, jobs)) {
+		warnp("Cannot check previously uploaded parts");
+		goto err6;
+	}
 
-		/* Append closing tag. */
-		s = "</part>";
-		if (str_append(manifest, s, strlen(s)))
-			goto err4;
+	/* Say what we're doing. */
+	fprintf(stderr, "Uploading %s to\nhttp://%s.s3.amazonaws.com/%s/\n",
+	    fname, bucket, noncehex);
+	if (U.stream)
+		fprintf(stderr, "in %zu-byte parts", U.partsz);
+	else
+		fprintf(stderr, "in %" PRId64 " part(s)", U.nparts);
+	if ((U.J != NULL) && (partjournal_ndone(U.J) > 0))
+		fprintf(stderr, " (%" PRIu64 " already uploaded)",
+		    partjournal_ndone(U.J));
+
+	/* Read, hash, and upload the parts. */
+	if (uploadparts(&U, jobs))
+		goto err6;
+	if (U.nparts == 0) {
+		warn0("Disk image is empty: %s", fname);
+		goto err6;
+	}
 
-		/* Free string allocated by asprintf. */
-		free(path);
+	/* If any parts were all zeroes, upload one for them to share. */
+	for (nzero = i = 0; i < U.nparts; i++) {
+		if (U.zeroparts[i])
+			nzero++;
 	}
+	if ((nzero > 0) && uploadzeropart(&U))
+		goto err6;
 
 	/* Report completion. */
 	fprintf(stderr, " done.\n");
+	if (U.stream)
+		fprintf(stderr, "Read %" PRId64 " bytes in %" PRIu64
+		    " part(s).\n", (int64_t)U.size, U.nparts);
+	if (nzero > 0)
+		fprintf(stderr, "%" PRIu64 " part(s) were all zeroes.\n",
+		    nzero);
+	if (U.nreused > 0)
+		fprintf(stderr, "%" PRIu64 " part(s) were already in S3.\n",
+		    U.nreused);
+
+	/* Prepare to generate presigned URLs, escaped for use in XML. */
+	if ((P = aws_sign_s3_presign_init(key_id, key_secret, region, bucket,
+	    604800, 1)) == NULL) {
+		warnp("Error generating presigned URL");
+		goto err6;
+	}
 
-	/* Append the end of the manifest file. */
-	s = "</parts></import></manifest>";
-	if (str_append(manifest, s, strlen(s)))
-		goto err3;
+	/* Construct the manifest. */
+	if ((s = ec2_manifest(P, bucket, noncehex, (uint64_t)U.size,
+	    partsz, U.zeroparts, (const uint8_t *)U.hashes, &len)) == NULL) {
+		warnp("Error constructing manifest");
+		goto err7;
+	}
 
-	/* Export manifest string. */
-	if (str_export(manifest, &s, &len))
-		goto err2;
+	/* We don't need the presigning state any more. */
+	aws_sign_s3_presign_free(P);
 
 	/* Say what we're doing. */
 	fprintf(stderr, "Uploading volume manifest...");
@@ -482,36 +1957,62 @@ uploadvolume(const char * fname, const char * region, const char * bucket,
 	/* Upload manifest. */
 	if (asprintf(&path, "/%s/manifest.xml", noncehex) == -1) {
 		free(s);
-		goto err2;
+		goto err6;
 	}
-	if (s3_put_loop(key_id, key_secret, region, bucket, path, s, len)) {
+	SHA256_Buf(s, len, hbuf);
+	hexify(hbuf, content_sha256, 32);
+	if (s3_put_loop(key_id, key_secret, region, bucket, path, s, len,
+	    content_sha256, NULL, NULL)) {
 		free(path);
 		free(s);
-		goto err2;
+		goto err6;
 	}
 	free(s);
 
 	/* Report completion. */
 	fprintf(stderr, " done.\n");
 
+	/* The parts are all uploaded, so we don't need the journal now. */
+	partjournal_close(U.J, 1);
+
+	/* Clean up upload state. */
+	free(U.hashes);
+	if (hashindex_close(U.H))
+		warnp("Error writing part index: %s", dedup);
+	free(U.zeroparts);
+	pthread_mutex_destroy(&U.mtx);
+	if (U.map != NULL)
+		munmap(U.map, (size_t)sb.st_size);
+	if (U.dfd != -1)
+		close(U.dfd);
+	xzreader_free(U.X);
+	close(U.fd);
+
 	/* Return disk image size. */
-	*size = sb.st_size;
+	*size = (uint64_t)U.size;
 
 	/* Return manifest file path. */
 	return (path);
 
+err7:
+	aws_sign_s3_presign_free(P);
 err6:
-	free(s);
+	free(U.hashes);
 err5:
-	free(query);
+	hashindex_close(U.H);
 err4:
-	free(path);
+	free(U.zeroparts);
 err3:
-	str_free(manifest);
+	pthread_mutex_destroy(&U.mtx);
 err2:
-	free(buf);
+	partjournal_close(U.J, 0);
 err1:
-	fclose(f);
+	if (U.map != NULL)
+		munmap(U.map, (size_t)sb.st_size);
+	if (U.dfd != -1)
+		close(U.dfd);
+	xzreader_free(U.X);
+	close(U.fd);
 err0:
 	/* Failure! */
 	return (NULL);
@@ -527,10 +2028,9 @@ ec2_apicall(const char * key_id, const char * key_secret, const char * region,
 	char * req;
 	char * host;
 	size_t len;
+	struct iovec iov;
 	const char * errstr;
-	uint8_t * resp;
-	size_t resplen;
-	size_t pos;
+	struct httpresp * resp;
 	uint8_t * body;
 
 	/* Sign request. */
@@ -542,13 +2042,12 @@ ec2_apicall(const char * key_id, const char * key_secret, const char * region,
 
 	/* Construct request and compute length. */
 	if (asprintf(&req,
-	    "POST / HTTP/1.0\r\n"
+	    "POST / HTTP/1.1\r\n"
 	    "Host: ec2.%s.amazonaws.com\r\n"
 	    "X-Amz-Date: %s\r\n"
 	    "X-Amz-Content-SHA256: %s\r\n"
 	    "Authorization: %s\r\n"
 	    "Content-Length: %zu\r\n"
-	    "Connection: close\r\n"
 	    "\r\n"
 	    "%s",
 	    region, x_amz_date, x_amz_content_sha256, authorization,
@@ -560,52 +2059,33 @@ ec2_apicall(const char * key_id, const char * key_secret, const char * region,
 	if (asprintf(&host, "ec2.%s.amazonaws.com", region) == -1)
 		goto err2;
 
-	/* Allocate space for a 16 kB response plus a trailing NUL. */
-	resplen = 16384;
-	if ((resp = malloc(resplen + 1)) == NULL)
-		goto err3;
-
 	/* Send the request. */
-	if ((errstr = sslreq(host, "443", CERTFILE, req, len, resp, &resplen))
-	    != NULL) {
+	iov.iov_base = req;
+	iov.iov_len = len;
+	if ((errstr = sslreq(host, "443", &iov, 1, &resp)) != NULL) {
 		warnp("SSL request failed: %s", errstr);
-		goto err4;
+		goto err3;
 	}
 
-	/* NUL-terminate the response. */
-	resp[resplen] = '\0';
-
 	/* EC2 API responses should not contain NUL bytes. */
-	if (strlen(resp) != resplen) {
+	if (strlen((char *)resp->body) != resp->bodylen) {
 		warnp("NUL byte in EC2 API response");
 		goto err4;
 	}
 
-        /* Find the end of the first line. */
-        pos = strcspn(resp, "\r\n");
-
-        /* Look for a "200" status on the first line. */
-        if ((strstr(resp, " 200 ") == NULL) ||
-            (strstr(resp, " 200 ") > (char *)&resp[pos])) {
-		warnp("EC2 API request failed:\n%s\n", resp);
-		goto err4;
-	}
-
-	/* Find the end of the headers. */
-	if ((body = strstr(resp, "\r\n\r\n")) == NULL) {
-		warnp("Bad EC2 API response received:\n%s\n", resp);
+	/* Check for a "200" status. */
+	if (resp->status != 200) {
+		warnp("EC2 API request failed: HTTP status %d\n%s\n",
+		    resp->status, resp->body);
 		goto err4;
 	}
 
-	/* Skip to the start of the response body. */
-	body = &body[4];
-
-	/* Duplicate response body. */
-	if ((body = strdup(body)) == NULL)
-		goto err4;
+	/* Take the response body. */
+	body = resp->body;
+	resp->body = NULL;
 
-	/* Free repsonse buffer. */
-	free(resp);
+	/* Free response. */
+	httpresp_free(resp);
 
 	/* Free request buffers. */
 	free(host);
@@ -618,7 +2098,7 @@ ec2_apicall(const char * key_id, const char * key_secret, const char * region,
 	return (body);
 
 err4:
-	free(resp);
+	httpresp_free(resp);
 err3:
 	free(host);
 err2:
@@ -1487,10 +2967,9 @@ sns_publish(const char * key_id, const char * key_secret,
 	char * req;
 	char * host;
 	size_t len;
+	struct iovec iov;
 	const char * errstr;
-	uint8_t * resp;
-	size_t resplen;
-	size_t pos;
+	struct httpresp * resp;
 	uint8_t * body;
 
 	/* Construct message subject. */
@@ -1572,14 +3051,13 @@ sns_publish(const char * key_id, const char * key_secret,
 
 	/* Construct request and compute length. */
 	if (asprintf(&req,
-	    "POST / HTTP/1.0\r\n"
+	    "POST / HTTP/1.1\r\n"
 	    "Host: sns.%s.amazonaws.com\r\n"
 	    "X-Amz-Date: %s\r\n"
 	    "X-Amz-Content-SHA256: %s\r\n"
 	    "Authorization: %s\r\n"
 	    "Content-Length: %zu\r\n"
 	    "Content-Type: application/x-www-form-urlencoded\r\n"
-	    "Connection: close\r\n"
 	    "\r\n"
 	    "%s",
 	    region, x_amz_date, x_amz_content_sha256, authorization,
@@ -1591,54 +3069,36 @@ sns_publish(const char * key_id, const char * key_secret,
 	if (asprintf(&host, "sns.%s.amazonaws.com", region) == -1)
 		goto err7;
 
-	/* Allocate space for a 16 kB response plus a trailing NUL. */
-	resplen = 16384;
-	if ((resp = malloc(resplen + 1)) == NULL)
-		goto err8;
-
 	/* Send the request. */
-	if ((errstr = sslreq(host, "443", CERTFILE, req, len, resp, &resplen))
-	    != NULL) {
+	iov.iov_base = req;
+	iov.iov_len = len;
+	if ((errstr = sslreq(host, "443", &iov, 1, &resp)) != NULL) {
 		warnp("SSL request failed: %s", errstr);
-		goto err9;
+		goto err8;
 	}
-
-	/* NUL-terminate the response. */
-	resp[resplen] = '\0';
+	body = resp->body;
 
 	/* SNS API responses should not contain NUL bytes. */
-	if (strlen(resp) != resplen) {
+	if (strlen((char *)body) != resp->bodylen) {
 		warnp("NUL byte in SNS API response");
 		goto err9;
 	}
 
-        /* Find the end of the first line. */
-        pos = strcspn(resp, "\r\n");
-
-        /* Look for a "200" status on the first line. */
-        if ((strstr(resp, " 200 ") == NULL) ||
-            (strstr(resp, " 200 ") > (char *)&resp[pos])) {
-		warnp("SNS API request failed:\n%s\n", resp);
-		goto err9;
-	}
-
-	/* Find the end of the headers. */
-	if ((body = strstr(resp, "\r\n\r\n")) == NULL) {
-		warnp("Bad SNS API response received:\n%s\n", resp);
+	/* Check for a "200" status. */
+	if (resp->status != 200) {
+		warnp("SNS API request failed: HTTP status %d\n%s\n",
+		    resp->status, body);
 		goto err9;
 	}
 
-	/* Skip to the start of the response body. */
-	body = &body[4];
-
 	/* Make sure there's a MessageId. */
-	if (strstr(body, "<MessageId>") == NULL) {
+	if (strstr((char *)body, "<MessageId>") == NULL) {
 		warnp("SNS API call failed?\n%s\n", body);
 		goto err9;
 	}
 
-	/* Free response buffer. */
-	free(resp);
+	/* Free response. */
+	httpresp_free(resp);
 
 	/* Free request buffers. */
 	free(host);
@@ -1656,7 +3116,7 @@ sns_publish(const char * key_id, const char * key_secret,
 	return (0);
 
 err9:
-	free(resp);
+	httpresp_free(resp);
 err8:
 	free(host);
 err7:
@@ -1680,6 +3140,66 @@ err0:
 	return (-1);
 }
 
+/*
+ * Record ${value} for ${key} in the state file ${S}; or if an earlier run
+ * recorded a different value, complain and fail.
+ */
+static int
+statecheck(struct statefile * S, const char * key, const char * value)
+{
+	const char * oldvalue;
+
+	/* Is there a conflicting value? */
+	if ((oldvalue = statefile_get(S, key)) != NULL) {
+		if (strcmp(oldvalue, value)) {
+			warn0("State file is for %s %s, not %s",
+			    key, oldvalue, value);
+			return (-1);
+		}
+		return (0);
+	}
+
+	/* Record the value. */
+	return (statefile_set(S, key, value));
+}
+
+/*
+ * Record the size and modification time of the disk image ${fname} in the
+ * state file ${S}; or if an earlier run recorded different ones, complain
+ * and fail.  Images which aren't regular files (e.g., pipes and devices)
+ * can't be identified this way, so they aren't checked.
+ */
+static int
+statecheckimage(struct statefile * S, const char * fname)
+{
+	struct stat sb;
+	char buf[48];
+
+	/* Standard input isn't a file we can look at. */
+	if (strcmp(fname, "-") == 0)
+		return (0);
+
+	/* Look at the image. */
+	if (stat(fname, &sb)) {
+		warnp("Cannot stat: %s", fname);
+		return (-1);
+	}
+	if (!S_ISREG(sb.st_mode))
+		return (0);
+
+	/* Check its size and modification time. */
+	snprintf(buf, sizeof(buf), "%jd", (intmax_t)sb.st_size);
+	if (statecheck(S, "image.size", buf))
+		return (-1);
+	snprintf(buf, sizeof(buf), "%jd.%09ld", (intmax_t)sb.st_mtim.tv_sec,
+	    (long)sb.st_mtim.tv_nsec);
+	if (statecheck(S, "image.mtime", buf))
+		return (-1);
+
+	/* Success! */
+	return (0);
+}
+
 int
 main(int argc, char * argv[])
 {
@@ -1697,18 +3217,38 @@ main(int argc, char * argv[])
 	const char * releaseversion;
 	const char * imageversion;
 	const char * arch = "x86_64";
+	int jobs = 1;
+	int unsignedpayload = 0;
+	int chunked = 0;
+	const char * sesscache = NULL;
+	const char * journal = NULL;
+	const char * dedup = NULL;
+	uint64_t partsz = PARTSZ;
+	int readdepth = READDEPTH;
+	int direct = 0;
+	long ljobs;
+	long ldepth;
+	long lpartsz;
+	char * eptr;
 	char * key_id;
 	char * key_secret;
 	char ** regions;
 	size_t nregions;
-	char * manifest;
+	const char * statefile = NULL;
+	int resume = 0;
+	struct statefile * S = NULL;
+	const char * manifest;
 	uint64_t size;
-	char * taskid;
-	char * volume;
-	char * snapshot;
-	char * ami;
+	char sizebuf[21];
+	const char * taskid;
+	const char * volume;
+	const char * snapshot;
+	const char * ami;
 	char ** amis;
+	char key[128];
+	const char * s;
 	size_t i;
+	const char * errstr;
 
 	WARNP_INIT;
 
@@ -1724,6 +3264,74 @@ main(int argc, char * argv[])
 			ena = 1;
 		else if (strcmp(argv[1], "--arm64") == 0)
 			arch = "arm64";
+		else if ((strcmp(argv[1], "--jobs") == 0) && (argc > 2)) {
+			ljobs = strtol(argv[2], &eptr, 10);
+			if ((*eptr != '\0') || (ljobs < 1) || (ljobs > 64)) {
+				warn0("--jobs must be between 1 and 64");
+				exit(1);
+			}
+			jobs = (int)ljobs;
+			argc--;
+			argv++;
+		} else if ((strcmp(argv[1], "--read-depth") == 0) &&
+		    (argc > 2)) {
+			ldepth = strtol(argv[2], &eptr, 10);
+			if ((*eptr != '\0') || (ldepth < 1) ||
+			    (ldepth > MAXREADDEPTH)) {
+				warn0("--read-depth must be between 1 and %d",
+				    MAXREADDEPTH);
+				exit(1);
+			}
+			readdepth = (int)ldepth;
+			argc--;
+			argv++;
+		} else if ((strcmp(argv[1], "--part-size") == 0) &&
+		    (argc > 2)) {
+			if (strcmp(argv[2], "auto") == 0) {
+				partsz = 0;
+			} else {
+				lpartsz = strtol(argv[2], &eptr, 10);
+				if ((*eptr != '\0') ||
+				    (lpartsz < MINPARTSZ / (1024 * 1024)) ||
+				    (lpartsz > MAXPARTSZ / (1024 * 1024))) {
+					warn0("--part-size must be \"auto\" or"
+					    " between %d and %d (MB)",
+					    MINPARTSZ / (1024 * 1024),
+					    MAXPARTSZ / (1024 * 1024));
+					exit(1);
+				}
+				partsz = (uint64_t)lpartsz * 1024 * 1024;
+			}
+			argc--;
+			argv++;
+		} else if ((strcmp(argv[1], "--session-cache") == 0) &&
+		    (argc > 2)) {
+			sesscache = argv[2];
+			argc--;
+			argv++;
+		} else if ((strcmp(argv[1], "--journal") == 0) &&
+		    (argc > 2)) {
+			journal = argv[2];
+			argc--;
+			argv++;
+		} else if ((strcmp(argv[1], "--dedup") == 0) &&
+		    (argc > 2)) {
+			dedup = argv[2];
+			argc--;
+			argv++;
+		} else if ((strcmp(argv[1], "--state") == 0) &&
+		    (argc > 2)) {
+			statefile = argv[2];
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--resume") == 0)
+			resume = 1;
+		else if (strcmp(argv[1], "--unsigned-payload") == 0)
+			unsignedpayload = 1;
+		else if (strcmp(argv[1], "--chunked") == 0)
+			chunked = 1;
+		else if (strcmp(argv[1], "--direct") == 0)
+			direct = 1;
 		else
 			break;
 		argc--;
@@ -1731,9 +3339,18 @@ main(int argc, char * argv[])
 	}
 
 	/* Sanity-check. */
-	if ((argc != 7) && (argc != 10)) {
+	if (((argc != 7) && (argc != 10)) || (unsignedpayload && chunked) ||
+	    (resume && (statefile == NULL)) ||
+	    ((dedup != NULL) && (unsignedpayload || chunked ||
+	    (journal != NULL)))) {
 		fprintf(stderr, "usage: bsdec2-image-upload [--public]"
-		    " [--publicsnap] [--sriov] [--ena] [--arm64]"
+		    " [--publicsnap] [--sriov] [--ena] [--arm64] [--jobs N]"
+		    " [--read-depth N] [--direct]"
+		    " [--part-size <MB> | --part-size auto]"
+		    " [--session-cache <file>]"
+		    " [--journal <file> | --dedup <index>]"
+		    " [--state <file> [--resume]]"
+		    " [--unsigned-payload | --chunked]"
 		    " %s %s %s %s %s %s [%s %s %s]\n",
 		    "<disk image>", "<name>", "<description>",
 		    "<region>", "<bucket>", "<AWS keyfile>",
@@ -1753,6 +3370,12 @@ main(int argc, char * argv[])
 		imageversion = argv[9];
 	}
 
+	/* Set up SSL for talking to AWS. */
+	if ((errstr = sslreq_init(CERTFILE, sesscache)) != NULL) {
+		warnp("Cannot initialize SSL: %s", errstr);
+		exit(1);
+	}
+
 	/* Load AWS keys. */
 	if (readkeys(keyfile, &key_id, &key_secret)) {
 		warnp("Cannot read AWS keys");
@@ -1765,72 +3388,133 @@ main(int argc, char * argv[])
 		exit(1);
 	}
 
-	/* Upload disk image. */
-	if ((manifest = uploadvolume(diskimg, region, bucket,
-	    &size, key_id, key_secret)) == NULL) {
-		warnp("Failure uploading disk image");
-		exit(1);
+	/* Open the state file, and make sure it's for this image. */
+	if (statefile != NULL) {
+		if ((S = statefile_open(statefile, resume)) == NULL) {
+			warnp("Cannot open state file: %s", statefile);
+			exit(1);
+		}
+		if (statecheck(S, "image", diskimg) ||
+		    statecheckimage(S, diskimg) ||
+		    statecheck(S, "region", region) ||
+		    statecheck(S, "bucket", bucket) ||
+		    statecheck(S, "name", name))
+			exit(1);
+	}
+
+	/* Upload disk image, unless an earlier run already did. */
+	if (((manifest = statefile_get(S, "manifest")) != NULL) &&
+	    ((s = statefile_get(S, "size")) != NULL)) {
+		size = strtoull(s, NULL, 10);
+		fprintf(stderr, "Using manifest %s from earlier run.\n",
+		    manifest);
+	} else {
+		if ((manifest = uploadvolume(diskimg, region, bucket,
+		    &size, key_id, key_secret, jobs, unsignedpayload,
+		    chunked, partsz, readdepth, direct, journal,
+		    dedup)) == NULL) {
+			warnp("Failure uploading disk image");
+			exit(1);
+		}
+		snprintf(sizebuf, sizeof(sizebuf), "%" PRIu64, size);
+		if (statefile_set(S, "size", sizebuf) ||
+		    statefile_set(S, "manifest", manifest))
+			exit(1);
 	}
 
 	/* Issue ImportVolume call. */
-	if ((taskid = importvolume(region, bucket, manifest, size,
-	    key_id, key_secret)) == NULL) {
-		warnp("Failure importing disk image");
-		exit(1);
+	if ((taskid = statefile_get(S, "taskid")) == NULL) {
+		if ((taskid = importvolume(region, bucket, manifest, size,
+		    key_id, key_secret)) == NULL) {
+			warnp("Failure importing disk image");
+			exit(1);
+		}
+		if (statefile_set(S, "taskid", taskid))
+			exit(1);
 	}
 
 	/* Wait for the volume to be ready. */
-	if ((volume = waitforimport(region, taskid,
-	    key_id, key_secret)) == NULL) {
-		warnp("Failure waiting for EBS volume");
-		exit(1);
+	if ((volume = statefile_get(S, "volume")) == NULL) {
+		if ((volume = waitforimport(region, taskid,
+		    key_id, key_secret)) == NULL) {
+			warnp("Failure waiting for EBS volume");
+			exit(1);
+		}
+		if (statefile_set(S, "volume", volume))
+			exit(1);
 	}
 
 	/* Create a snapshot. */
-	if ((snapshot = createsnapshot(region, volume,
-	    key_id, key_secret)) == NULL) {
-		warnp("Failure creating snapshot");
-		exit(1);
+	if ((snapshot = statefile_get(S, "snapshot")) == NULL) {
+		if ((snapshot = createsnapshot(region, volume,
+		    key_id, key_secret)) == NULL) {
+			warnp("Failure creating snapshot");
+			exit(1);
+		}
+		if (statefile_set(S, "snapshot", snapshot))
+			exit(1);
 	}
 
 	/* Wait for the snapshot to be ready. */
-	if (waitforsnapshot(region, snapshot, key_id, key_secret)) {
-		warnp("Failure waiting for EBS snapshot");
-		exit(1);
+	if (statefile_get(S, "snapshot.ready") == NULL) {
+		if (waitforsnapshot(region, snapshot, key_id, key_secret)) {
+			warnp("Failure waiting for EBS snapshot");
+			exit(1);
+		}
+		if (statefile_set(S, "snapshot.ready", "1"))
+			exit(1);
 	}
 
 	/* Delete the volume now that it is snapshotted. */
-	if (deletevolume(region, volume, key_id, key_secret)) {
-		warnp("Failure deleting EBS volume");
-		exit(1);
+	if (statefile_get(S, "volume.deleted") == NULL) {
+		if (deletevolume(region, volume, key_id, key_secret)) {
+			warnp("Failure deleting EBS volume");
+			exit(1);
+		}
+		if (statefile_set(S, "volume.deleted", "1"))
+			exit(1);
 	}
 
 	/* Mark snapshot as public. */
-	if (publicsnap) {
+	if (publicsnap && (statefile_get(S, "snapshot.public") == NULL)) {
 		fprintf(stderr, "Marking %s in %s as public...", snapshot, region);
 		if (makesnappublic(region, snapshot, key_id, key_secret)) {
 			warnp("Error marking EBS snapshot as public");
 			exit(1);
 		}
 		fprintf(stderr, " done.\n");
+		if (statefile_set(S, "snapshot.public", "1"))
+			exit(1);
 	}
 
 	/* Register an image. */
-	if ((ami = registerimage(region, snapshot, name, desc, arch, sriov,
-	    ena, key_id, key_secret)) == NULL) {
-		warnp("Failure registering AMI");
-		exit(1);
+	if ((ami = statefile_get(S, "ami")) == NULL) {
+		if ((ami = registerimage(region, snapshot, name, desc, arch,
+		    sriov, ena, key_id, key_secret)) == NULL) {
+			warnp("Failure registering AMI");
+			exit(1);
+		}
+		if (statefile_set(S, "ami", ami))
+			exit(1);
 	}
 
 	/* Wait for the AMI to be ready. */
-	if (waitforami(region, ami, key_id, key_secret)) {
-		warnp("Failure waiting for AMI");
-		exit(1);
+	if (statefile_get(S, "ami.ready") == NULL) {
+		if (waitforami(region, ami, key_id, key_secret)) {
+			warnp("Failure waiting for AMI");
+			exit(1);
+		}
+		if (statefile_set(S, "ami.ready", "1"))
+			exit(1);
 	}
 
 	/* If we're not making public images, stop here. */
 	if (!public) {
 		printf("Created AMI in %s region: %s\n", region, ami);
+		statefile_free(S);
+		if ((errstr = sslreq_done()) != NULL)
+			warnp("Error cleaning up SSL: %s", errstr);
+		aws_sign_cleanup();
 		exit(0);
 	}
 
@@ -1840,7 +3524,10 @@ main(int argc, char * argv[])
 		exit(1);
 	}
 
-	/* Copy images into the regions. */
+	/*
+	 * Copy images into the regions.  Copies started by an earlier run
+	 * may still be in progress; we wait for them along with the others.
+	 */
 	fprintf(stderr, "Copying AMI to regions:");
 	for (i = 0; i < nregions; i++) {
 		/* Don't copy to the region where we built the image. */
@@ -1852,12 +3539,24 @@ main(int argc, char * argv[])
 			continue;
 		}
 
+		/* Did an earlier run already start this copy? */
+		snprintf(key, sizeof(key), "copy.%s", regions[i]);
+		if ((s = statefile_get(S, key)) != NULL) {
+			if ((amis[i] = strdup(s)) == NULL) {
+				warnp("strdup");
+				exit(1);
+			}
+			continue;
+		}
+
 		fprintf(stderr, " %s", regions[i]);
 		if ((amis[i] = copyimage(region, ami, regions[i],
 		    key_id, key_secret)) == NULL) {
 			warnp("Error copying AMI to region %s", regions[i]);
 			exit(1);
 		}
+		if (statefile_set(S, key, amis[i]))
+			exit(1);
 	}
 	fprintf(stderr, ".\n");
 
@@ -1866,21 +3565,33 @@ main(int argc, char * argv[])
 		if (strcmp(regions[i], region) == 0)
 			continue;
 
+		/* Did an earlier run already see this copy complete? */
+		snprintf(key, sizeof(key), "copy.%s.ready", regions[i]);
+		if (statefile_get(S, key) != NULL)
+			continue;
+
 		/* Wait for AMI to finish copying. */
 		fprintf(stderr, "Waiting for AMI copying to %s...", regions[i]);
 		if (waitforami(regions[i], amis[i], key_id, key_secret)) {
 			warnp("Failure waiting for AMI");
 			exit(1);
 		}
+		if (statefile_set(S, key, "1"))
+			exit(1);
 	}
 
 	/* Mark images as public. */
 	fprintf(stderr, "Marking images as public...");
 	for (i = 0; i < nregions; i++) {
+		snprintf(key, sizeof(key), "public.%s", regions[i]);
+		if (statefile_get(S, key) != NULL)
+			continue;
 		if (makepublic(regions[i], amis[i], key_id, key_secret)) {
 			warnp("Error marking AMI as public");
 			exit(1);
 		}
+		if (statefile_set(S, key, "1"))
+			exit(1);
 	}
 	fprintf(stderr, " done.\n");
 
@@ -1889,13 +3600,24 @@ main(int argc, char * argv[])
 		printf("Created AMI in %s region: %s\n", regions[i], amis[i]);
 
 	/* Try to send an SNS notification if desired. */
-	if (topicarn) {
+	if (topicarn && (statefile_get(S, "notified") == NULL)) {
 		if (sns_publish(key_id, key_secret, topicarn,
 		    releaseversion, imageversion, name,
 		    nregions, regions, amis)) {
 			warnp("Failed to send SNS notification");
-		}
+		} else if (statefile_set(S, "notified", "1"))
+			exit(1);
 	}
 
+	/* We're done with the state file. */
+	statefile_free(S);
+
+	/* Close any connections we're holding open and clean up SSL. */
+	if ((errstr = sslreq_done()) != NULL)
+		warnp("Error cleaning up SSL: %s", errstr);
+
+	/* Erase the signing keys we derived from the AWS secret key. */
+	aws_sign_cleanup();
+
 	return (0);
 }